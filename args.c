@@ -106,3 +106,86 @@ void args_strip(ARGS *args, const char *prefix)
 		}
 	}
 }
+
+/*
+ * Create an argument list from the contents of a response file given to gcc
+ * as @file. Arguments are separated by whitespace; single and double quotes
+ * group characters into an argument and a backslash escapes the next
+ * character, also within quotes. Returns NULL if the file can't be read.
+ */
+ARGS *args_init_from_gcc_atfile(const char *filename)
+{
+	ARGS *args;
+	char *data, *p, *end, *arg, *q;
+	size_t size;
+	char quote = 0;
+	int in_arg = 0;
+
+	data = read_whole_file(filename, &size);
+	if (!data) {
+		return NULL;
+	}
+
+	args = args_init(0, NULL);
+	arg = x_malloc(size + 1);
+	q = arg;
+	end = data + size;
+	for (p = data; p < end; p++) {
+		if (*p == '\\' && p + 1 < end) {
+			*q++ = *++p;
+			in_arg = 1;
+		} else if (quote) {
+			if (*p == quote) {
+				quote = 0;
+			} else {
+				*q++ = *p;
+			}
+		} else if (*p == '\'' || *p == '"') {
+			quote = *p;
+			in_arg = 1;
+		} else if (*p == ' ' || *p == '\t' || *p == '\n'
+			   || *p == '\r' || *p == '\f' || *p == '\v') {
+			if (in_arg) {
+				*q = 0;
+				args_add(args, arg);
+				q = arg;
+				in_arg = 0;
+			}
+		} else {
+			*q++ = *p;
+			in_arg = 1;
+		}
+	}
+	if (in_arg) {
+		*q = 0;
+		args_add(args, arg);
+	}
+
+	free(arg);
+	free(data);
+	return args;
+}
+
+/*
+ * Insert the arguments of src into dest at index, replacing the argument
+ * there if replace is true. Takes over ownership of src.
+ */
+void args_insert(ARGS *dest, int index, ARGS *src, int replace)
+{
+	int removed = replace ? 1 : 0;
+
+	dest->argv = (char **)x_realloc(
+		dest->argv,
+		(dest->argc + src->argc - removed + 1) * sizeof(char *));
+	if (replace) {
+		free(dest->argv[index]);
+	}
+	memmove(&dest->argv[index + src->argc],
+		&dest->argv[index + removed],
+		(dest->argc - index - removed + 1) * sizeof(char *));
+	memcpy(&dest->argv[index], src->argv, src->argc * sizeof(char *));
+	dest->argc += src->argc - removed;
+
+	free(src->argv);
+	free(src);
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2010 Joel Rosdahl
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Batch mode: run all compilations of a compilation database
+ * (compile_commands.json) in one ccache process. The compilations are run by
+ * server_run_jobs() in forked workers that share the hashes of include files.
+ *
+ * A compilation database is a JSON array of objects with the members
+ * "directory", "file" and either "arguments" (an array of strings) or
+ * "command" (a string that is split like a shell would split it).
+ */
+
+#include "ccache.h"
+#include "batch.h"
+#include "server.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct json {
+	const char *path;
+	const char *start;
+	const char *p;
+	const char *end;
+};
+
+/* One entry of a compilation database. */
+struct entry {
+	char *directory;
+	char *file;
+	ARGS *args;
+};
+
+static void json_error(struct json *j, const char *message)
+{
+	fatal("%s: %s at offset %lu",
+	      j->path, message, (unsigned long)(j->p - j->start));
+}
+
+static void skip_space(struct json *j)
+{
+	while (j->p < j->end
+	       && (*j->p == ' ' || *j->p == '\t' || *j->p == '\n'
+		   || *j->p == '\r')) {
+		j->p++;
+	}
+}
+
+/* Skip space and the character c if it follows. Returns whether it did. */
+static int accept_char(struct json *j, char c)
+{
+	skip_space(j);
+	if (j->p < j->end && *j->p == c) {
+		j->p++;
+		return 1;
+	}
+	return 0;
+}
+
+static void expect_char(struct json *j, char c)
+{
+	char message[32];
+
+	if (!accept_char(j, c)) {
+		snprintf(message, sizeof(message), "expected '%c'", c);
+		json_error(j, message);
+	}
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static unsigned parse_hex4(struct json *j)
+{
+	unsigned value = 0;
+	int i, digit;
+
+	for (i = 0; i < 4; i++) {
+		digit = j->p < j->end ? hex_value(*j->p) : -1;
+		if (digit < 0) {
+			json_error(j, "invalid \\u escape");
+		}
+		value = value * 16 + digit;
+		j->p++;
+	}
+	return value;
+}
+
+/* Add a code point to a string as UTF-8. */
+static char *add_utf8(char *q, unsigned c)
+{
+	if (c < 0x80) {
+		*q++ = c;
+	} else if (c < 0x800) {
+		*q++ = 0xC0 | (c >> 6);
+		*q++ = 0x80 | (c & 0x3F);
+	} else if (c < 0x10000) {
+		*q++ = 0xE0 | (c >> 12);
+		*q++ = 0x80 | ((c >> 6) & 0x3F);
+		*q++ = 0x80 | (c & 0x3F);
+	} else {
+		*q++ = 0xF0 | (c >> 18);
+		*q++ = 0x80 | ((c >> 12) & 0x3F);
+		*q++ = 0x80 | ((c >> 6) & 0x3F);
+		*q++ = 0x80 | (c & 0x3F);
+	}
+	return q;
+}
+
+/* Parse a string. Caller frees. */
+static char *parse_string(struct json *j)
+{
+	const char *start;
+	char *result, *q;
+	unsigned c, low;
+
+	expect_char(j, '"');
+	start = j->p;
+	while (j->p < j->end && *j->p != '"') {
+		if (*j->p == '\\') {
+			j->p++;
+		}
+		j->p++;
+	}
+	if (j->p >= j->end) {
+		json_error(j, "unterminated string");
+	}
+
+	/* Escapes never make the string longer. */
+	result = x_malloc(j->p - start + 1);
+	q = result;
+	j->p = start;
+	while (*j->p != '"') {
+		if (*j->p != '\\') {
+			*q++ = *j->p++;
+			continue;
+		}
+		j->p++;
+		switch (*j->p++) {
+		case '"': *q++ = '"'; break;
+		case '\\': *q++ = '\\'; break;
+		case '/': *q++ = '/'; break;
+		case 'b': *q++ = '\b'; break;
+		case 'f': *q++ = '\f'; break;
+		case 'n': *q++ = '\n'; break;
+		case 'r': *q++ = '\r'; break;
+		case 't': *q++ = '\t'; break;
+		case 'u':
+			c = parse_hex4(j);
+			if (c >= 0xDC00 && c < 0xE000) {
+				json_error(j, "invalid surrogate pair");
+			}
+			if (c >= 0xD800 && c < 0xDC00) {
+				if (j->end - j->p < 6
+				    || j->p[0] != '\\' || j->p[1] != 'u') {
+					json_error(j, "invalid surrogate pair");
+				}
+				j->p += 2;
+				low = parse_hex4(j);
+				if (low < 0xDC00 || low >= 0xE000) {
+					json_error(j, "invalid surrogate pair");
+				}
+				c = 0x10000 + ((c - 0xD800) << 10)
+					+ (low - 0xDC00);
+			}
+			if (c == 0) {
+				json_error(j, "NUL in string");
+			}
+			q = add_utf8(q, c);
+			break;
+		default:
+			j->p--;
+			json_error(j, "invalid escape");
+		}
+	}
+	*q = '\0';
+	j->p++;
+	return result;
+}
+
+static void skip_value(struct json *j)
+{
+	skip_space(j);
+	if (j->p >= j->end) {
+		json_error(j, "unexpected end of file");
+	}
+	switch (*j->p) {
+	case '"':
+		free(parse_string(j));
+		break;
+
+	case '[':
+		j->p++;
+		if (accept_char(j, ']')) {
+			break;
+		}
+		do {
+			skip_value(j);
+		} while (accept_char(j, ','));
+		expect_char(j, ']');
+		break;
+
+	case '{':
+		j->p++;
+		if (accept_char(j, '}')) {
+			break;
+		}
+		do {
+			free(parse_string(j));
+			expect_char(j, ':');
+			skip_value(j);
+		} while (accept_char(j, ','));
+		expect_char(j, '}');
+		break;
+
+	default:
+		/* Number, true, false or null. */
+		if (!*j->p || !strchr("-0123456789tfn", *j->p)) {
+			json_error(j, "invalid value");
+		}
+		while (j->p < j->end && *j->p
+		       && strchr("+-.0123456789Eeaflnrstu", *j->p)) {
+			j->p++;
+		}
+		break;
+	}
+}
+
+/* Parse an array of strings. */
+static ARGS *parse_string_array(struct json *j)
+{
+	ARGS *args = args_init(0, NULL);
+	char *s;
+
+	expect_char(j, '[');
+	if (accept_char(j, ']')) {
+		return args;
+	}
+	do {
+		s = parse_string(j);
+		args_add(args, s);
+		free(s);
+	} while (accept_char(j, ','));
+	expect_char(j, ']');
+	return args;
+}
+
+/*
+ * Split a command into arguments like a POSIX shell does, without expansions.
+ * Returns NULL on unbalanced quotes.
+ */
+static ARGS *split_command(const char *command)
+{
+	ARGS *args = args_init(0, NULL);
+	char *arg = x_malloc(strlen(command) + 1);
+	const char *p = command;
+	char *q;
+	int in_arg;
+
+	while (1) {
+		while (*p == ' ' || *p == '\t' || *p == '\n') {
+			p++;
+		}
+		if (!*p) {
+			break;
+		}
+		q = arg;
+		in_arg = 1;
+		while (in_arg && *p) {
+			switch (*p) {
+			case ' ': case '\t': case '\n':
+				in_arg = 0;
+				break;
+
+			case '\\':
+				p++;
+				if (*p) {
+					*q++ = *p++;
+				}
+				break;
+
+			case '\'':
+				p++;
+				while (*p && *p != '\'') {
+					*q++ = *p++;
+				}
+				if (!*p) {
+					goto error;
+				}
+				p++;
+				break;
+
+			case '"':
+				p++;
+				while (*p && *p != '"') {
+					if (*p == '\\' && p[1]
+					    && strchr("\"\\$`", p[1])) {
+						p++;
+					}
+					*q++ = *p++;
+				}
+				if (!*p) {
+					goto error;
+				}
+				p++;
+				break;
+
+			default:
+				*q++ = *p++;
+				break;
+			}
+		}
+		*q = '\0';
+		args_add(args, arg);
+	}
+	free(arg);
+	return args;
+
+error:
+	free(arg);
+	args_free(args);
+	return NULL;
+}
+
+static void parse_entry(struct json *j, struct entry *e)
+{
+	char *key, *command = NULL;
+
+	e->directory = NULL;
+	e->file = NULL;
+	e->args = NULL;
+
+	expect_char(j, '{');
+	if (!accept_char(j, '}')) {
+		do {
+			key = parse_string(j);
+			expect_char(j, ':');
+			if (strcmp(key, "directory") == 0) {
+				free(e->directory);
+				e->directory = parse_string(j);
+			} else if (strcmp(key, "file") == 0) {
+				free(e->file);
+				e->file = parse_string(j);
+			} else if (strcmp(key, "arguments") == 0) {
+				if (e->args) {
+					args_free(e->args);
+				}
+				e->args = parse_string_array(j);
+			} else if (strcmp(key, "command") == 0) {
+				free(command);
+				command = parse_string(j);
+			} else {
+				skip_value(j);
+			}
+			free(key);
+		} while (accept_char(j, ','));
+		expect_char(j, '}');
+	}
+
+	if (!e->directory || !e->file || (!e->args && !command)) {
+		json_error(j, "entry lacks directory, file or command");
+	}
+	if (!e->args) {
+		/* "arguments" wins if both are given. */
+		e->args = split_command(command);
+		if (!e->args) {
+			json_error(j, "unbalanced quotes in command");
+		}
+	}
+	free(command);
+	if (e->args->argc == 0) {
+		json_error(j, "empty command");
+	}
+}
+
+/* Parse a compilation database. Returns the number of entries. */
+static int parse_database(struct json *j, struct entry **entries)
+{
+	int n = 0, allocated = 0;
+
+	*entries = NULL;
+	expect_char(j, '[');
+	if (!accept_char(j, ']')) {
+		do {
+			if (n == allocated) {
+				allocated = 2 * allocated + 64;
+				*entries = x_realloc(*entries,
+						     allocated * sizeof(**entries));
+			}
+			parse_entry(j, &(*entries)[n]);
+			n++;
+		} while (accept_char(j, ','));
+		expect_char(j, ']');
+	}
+	skip_space(j);
+	if (j->p != j->end) {
+		json_error(j, "garbage after the array");
+	}
+	return n;
+}
+
+/*
+ * Run the compilations of the compilation database at path, at most parallel
+ * at a time. Each compilation is run by calling compile with "ccache" and the
+ * command of the entry. Returns 0 if all compilations succeeded, otherwise 1.
+ */
+int batch_main(const char *path, int parallel,
+	       int (*compile)(int argc, char *argv[]))
+{
+	struct json j;
+	struct entry *entries;
+	struct server_job *jobs;
+	char *data, *name;
+	size_t size = 0;
+	int n, i, failures;
+
+	data = read_whole_file(path, &size);
+	if (!data) {
+		fatal("Failed to read %s (%s)", path, strerror(errno));
+	}
+	j.path = path;
+	j.start = data;
+	j.p = data;
+	j.end = data + size;
+	n = parse_database(&j, &entries);
+	free(data);
+
+	jobs = x_malloc((n > 0 ? n : 1) * sizeof(*jobs));
+	for (i = 0; i < n; i++) {
+		/* Let main() treat the command as "ccache compiler ...". */
+		name = basename(entries[i].args->argv[0]);
+		if (strcmp(name, MYNAME) != 0) {
+			args_add_prefix(entries[i].args, MYNAME);
+		}
+		free(name);
+		jobs[i].directory = entries[i].directory;
+		jobs[i].file = entries[i].file;
+		jobs[i].argc = entries[i].args->argc;
+		jobs[i].argv = entries[i].args->argv;
+	}
+
+	cc_log("Running %d compilations from %s", n, path);
+	failures = server_run_jobs(jobs, n, parallel > 0 ? parallel : 1,
+				   compile);
+
+	for (i = 0; i < n; i++) {
+		free(entries[i].directory);
+		free(entries[i].file);
+		args_free(entries[i].args);
+	}
+	free(entries);
+	free(jobs);
+
+	if (failures > 0) {
+		fprintf(stderr, "ccache: %d of %d compilations failed\n",
+			failures, n);
+		return 1;
+	}
+	return 0;
+}
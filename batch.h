@@ -0,0 +1,7 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+int batch_main(const char *path, int parallel,
+               int (*compile)(int argc, char *argv[]));
+
+#endif
@@ -20,17 +20,22 @@
  */
 
 #include "ccache.h"
+#include "batch.h"
 #include "getopt_long.h"
 #include "hashtable.h"
 #include "hashtable_itr.h"
 #include "hashutil.h"
+#include "jobserver.h"
 #include "manifest.h"
+#include "server.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -55,15 +60,28 @@ static const char USAGE_TEXT[] =
 "    compiler [compiler options]          (via symbolic link)\n"
 "\n"
 "Options:\n"
+"        --batch=FILE      run the compilations of the compilation database\n"
+"                          FILE (compile_commands.json) in parallel\n"
 "    -c, --cleanup         delete old files and recalculate size counters\n"
 "                          (normally not needed as this is done automatically)\n"
+"        --background      with -c, clean up in a detached low-priority process\n"
 "    -C, --clear           clear the cache completely\n"
+"    -j, --jobs=N          with --batch or --prefetch, handle N compilations at\n"
+"                          a time (default: the number of processors)\n"
 "    -F, --max-files=N     set maximum number of files in cache to N (use 0 for\n"
 "                          no limit)\n"
 "    -M, --max-size=SIZE   set maximum size of cache to SIZE (use 0 for no\n"
 "                          limit; available suffixes: G, M and K; default\n"
 "                          suffix: G)\n"
 "    -s, --show-stats      show statistics summary\n"
+"        --server          serve compilations on the socket named by\n"
+"                          CCACHE_SERVER until terminated\n"
+"        --show-latency    show latency percentiles of the compilation phases\n"
+"        --prefetch=FILE   predict which compilations of the compilation\n"
+"                          database FILE are hits and warm the caches for them\n"
+"        --print-stats     print raw statistics in a machine-readable format\n"
+"        --format=FORMAT   with --print-stats, use FORMAT (json or prometheus;\n"
+"                          default: json)\n"
 "    -z, --zero-stats      zero statistics counters\n"
 "\n"
 "    -h, --help            print this help text\n"
@@ -128,12 +146,53 @@ static char *cached_dep;
  */
 static char *manifest_path;
 
+/*
+ * Lease file that tells other ccache processes that this process is
+ * compiling the object (cachedir/a/b/cdef[...]-size.o.tmp.lease), or NULL.
+ */
+static char *lease_path;
+
 /*
  * Time of compilation. Used to see if include files have changed after
  * compilation.
  */
 static time_t time_of_compilation;
 
+/*
+ * Preprocessor started before the direct mode lookup (CCACHE_EARLYCPP) and
+ * the temporary file it writes to, or NULL if it isn't running.
+ */
+static struct process early_cpp;
+static char *early_cpp_stdout;
+
+/*
+ * Compiler started before the object hash is known (CCACHE_SPECULATE and
+ * CCACHE_DEPEND), the temporary object file it writes, or NULL if there is
+ * none, and its output and exit status once it has finished.
+ */
+static struct process early_compiler;
+static char *early_compiler_obj;
+static struct output early_compiler_out;
+static struct output early_compiler_err;
+static struct timeval early_compiler_start;
+static struct timeval early_compiler_end;
+static int early_compiler_finished;
+static int early_compiler_status;
+static int early_compiler_token;
+
+/*
+ * File that marks that the last lookup of this compilation was a miss, and
+ * whether it exists. NULL unless CCACHE_SPECULATE is set.
+ */
+static char *miss_marker;
+static int miss_marker_exists;
+
+/* Number of background processes and the signal handlers they replaced. */
+static int n_background;
+static struct sigaction old_sigint;
+static struct sigaction old_sigterm;
+static struct sigaction old_sighup;
+
 /* Bitmask of SLOPPY_*. */
 unsigned sloppiness = 0;
 
@@ -146,6 +205,21 @@ static struct hashtable *included_files;
 /* is gcc being asked to output dependencies? */
 static int generating_dependencies;
 
+/* do they include system headers (-MD rather than -MMD)? */
+static int generating_system_dependencies;
+
+/* is a precompiled header given with -include? */
+static int using_precompiled_header;
+
+/* is the output a precompiled header (the input file is a header)? */
+static int output_is_precompiled_header;
+
+/*
+ * The direct mode hash before the manifest name was taken from it, which
+ * depend mode continues from.
+ */
+static struct mdfour depend_mode_hash;
+
 /* the extension of the file (without dot) after pre-processing */
 static const char *i_extension;
 
@@ -155,8 +229,8 @@ static char *i_tmpfile;
 /* are we compiling a .i or .ii file directly? */
 static int direct_i_file;
 
-/* the name of the cpp stderr file */
-static char *cpp_stderr;
+/* the stderr of the preprocessor */
+static struct output *cpp_stderr;
 
 /*
  * Full path to the statistics file in the subdirectory where the cached result
@@ -170,6 +244,9 @@ static int enable_unify;
 /* should we use the direct mode? */
 static int enable_direct = 1;
 
+/* should we only predict whether the compilation is a hit (--prefetch)? */
+static int prefetch_only;
+
 /*
  * Whether to enable compression of files stored in the cache. (Manifest files
  * are always compressed.)
@@ -210,6 +287,16 @@ static const struct {
 	{".m",   "objective-c"},
 	{".M",   "objective-c++"},
 	{".mm",  "objective-c++"},
+	{".h",   "c-header"},
+	{".H",   "c++-header"},
+	{".hh",  "c++-header"},
+	{".HH",  "c++-header"},
+	{".hpp", "c++-header"},
+	{".HPP", "c++-header"},
+	{".hxx", "c++-header"},
+	{".HXX", "c++-header"},
+	{".h++", "c++-header"},
+	{".H++", "c++-header"},
 	{NULL,  NULL}};
 
 /*
@@ -227,6 +314,10 @@ static const struct {
 	{"objc-cpp-output",   ".mi"},
 	{"objective-c++",     ".mii"},
 	{"objc++-cpp-output", ".mii"},
+	{"c-header",          ".i"},
+	{"c++-header",        ".ii"},
+	{"objective-c-header",   ".mi"},
+	{"objective-c++-header", ".mii"},
 	{NULL,  NULL}};
 
 enum fromcache_call_mode {
@@ -244,6 +335,281 @@ enum fromcache_call_mode {
  */
 static const char HASH_PREFIX[] = "3";
 
+/* Give up the lease, if any, so that waiting processes stop waiting. */
+static void release_lease(void)
+{
+	if (lease_path) {
+		unlink(lease_path);
+		free(lease_path);
+		lease_path = NULL;
+	}
+}
+
+/*
+ * Print the predicted result of the compilation for --prefetch and exit
+ * without compiling or updating the statistics.
+ */
+static void prefetch_result(const char *result)
+{
+	char *line;
+
+	if (!input_file) {
+		x_asprintf(&line, "%s -\n", result);
+	} else if (input_file[0] == '/') {
+		x_asprintf(&line, "%s %s\n", result, input_file);
+	} else {
+		x_asprintf(&line, "%s %s/%s\n",
+			   result, current_working_dir, input_file);
+	}
+	/* One write so that lines from parallel workers don't mix. */
+	if (write(1, line, strlen(line)) != (ssize_t)strlen(line)) {
+		_exit(1);
+	}
+	_exit(0);
+}
+
+/*
+ * Return a new temporary path for the preprocessed input file:
+ * ~/hello.c -> tmp.hello.123.i
+ */
+static char *
+preprocessed_path(void)
+{
+	char *input_base;
+	char *tmp;
+	char *path;
+
+	/* limit the basename to 10
+	   characters in order to cope with filesystem with small
+	   maximum filename length limits */
+	input_base = basename(input_file);
+	tmp = strchr(input_base, '.');
+	if (tmp != NULL) {
+		*tmp = 0;
+	}
+	if (strlen(input_base) > 10) {
+		input_base[10] = 0;
+	}
+
+	x_asprintf(&path, "%s/%s.tmp.%s.%s", temp_dir,
+		   input_base, tmp_string(), i_extension);
+	free(input_base);
+	return path;
+}
+
+/*
+ * Note that a background process is done, restoring the signal handlers
+ * when it was the last one.
+ */
+static void background_done(void)
+{
+	if (--n_background == 0) {
+		sigaction(SIGINT, &old_sigint, NULL);
+		sigaction(SIGTERM, &old_sigterm, NULL);
+		sigaction(SIGHUP, &old_sighup, NULL);
+	}
+}
+
+/*
+ * Stop the early preprocessor, if it is running, since its output isn't
+ * needed.
+ */
+static void stop_early_cpp(void)
+{
+	if (!early_cpp_stdout) {
+		return;
+	}
+	execute_kill(&early_cpp);
+	unlink(early_cpp_stdout);
+	free(early_cpp_stdout);
+	early_cpp_stdout = NULL;
+	background_done();
+	jobserver_release();
+	cc_log("Stopped the early preprocessor");
+}
+
+/* Wait for the early compiler to finish, keeping its result. */
+static void finish_early_compiler(void)
+{
+	early_compiler_status = execute_finish(
+		&early_compiler, &early_compiler_out, &early_compiler_err);
+	gettimeofday(&early_compiler_end, NULL);
+	early_compiler_finished = 1;
+	background_done();
+	if (early_compiler_token) {
+		jobserver_release();
+		early_compiler_token = 0;
+	}
+}
+
+/*
+ * Stop the early compiler, if it was started, since the result was found in
+ * the cache.
+ */
+static void stop_early_compiler(void)
+{
+	if (!early_compiler_obj) {
+		return;
+	}
+	if (!early_compiler_finished) {
+		execute_kill(&early_compiler);
+		background_done();
+		if (early_compiler_token) {
+			jobserver_release();
+			early_compiler_token = 0;
+		}
+	}
+	unlink(early_compiler_obj);
+	free(early_compiler_obj);
+	early_compiler_obj = NULL;
+	output_free(&early_compiler_out);
+	output_free(&early_compiler_err);
+	cc_log("Stopped the compiler started early");
+}
+
+static void stop_background(void)
+{
+	stop_early_cpp();
+	stop_early_compiler();
+}
+
+/* Don't leave background processes behind when ccache is interrupted. */
+static void background_signal_handler(int signum)
+{
+	if (early_cpp_stdout) {
+		kill(-early_cpp.pid, SIGTERM);
+	}
+	if (early_compiler_obj && !early_compiler_finished) {
+		kill(-early_compiler.pid, SIGTERM);
+	}
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+/*
+ * Note that a process has been started in the background, and make sure it
+ * doesn't outlive ccache.
+ */
+static void background_started(void)
+{
+	static int registered;
+	struct sigaction sa;
+
+	if (n_background++ == 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = background_signal_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, &old_sigint);
+		sigaction(SIGTERM, &sa, &old_sigterm);
+		sigaction(SIGHUP, &sa, &old_sighup);
+	}
+	if (!registered) {
+		atexit(stop_background);
+		registered = 1;
+	}
+}
+
+/*
+ * Start running the preprocessor on the input file while the direct mode
+ * lookup is being done, so that a direct mode miss doesn't have to wait for
+ * the whole preprocessor run afterwards. The preprocessor is stopped if the
+ * lookup is a hit. This costs an extra process for a while, so it takes a
+ * jobserver token if ccache runs under make -j.
+ */
+static void start_early_cpp(ARGS *args)
+{
+	char *path;
+	int status;
+
+	if (direct_i_file || generating_dependencies) {
+		/* nothing to do, or the dependency file would be raced */
+		return;
+	}
+	if (!jobserver_acquire(0)) {
+		cc_log("No jobserver token for the early preprocessor");
+		return;
+	}
+
+	path = preprocessed_path();
+	time_of_compilation = time(NULL);
+	args_add(args, "-E");
+	args_add(args, input_file);
+	status = execute_start(args->argv, path, 1, &early_cpp);
+	args_pop(args, 2);
+	if (status != 0) {
+		/* it will be retried and fail properly after the lookup */
+		unlink(path);
+		free(path);
+		jobserver_release();
+		return;
+	}
+	early_cpp_stdout = path;
+	background_started();
+	cc_log("Started the preprocessor early");
+}
+
+/*
+ * Start the real compiler on the source file before the object hash is
+ * known, compiling it like with CCACHE_CPP2. to_cache() takes over the
+ * result. Returns whether the compiler could be started.
+ */
+static int start_early_compiler(ARGS *args)
+{
+	char *path;
+	int status;
+
+	x_asprintf(&path, "%s/tmp.early_stdout.%s", temp_dir, tmp_string());
+	output_init(&early_compiler_out, path);
+	free(path);
+	x_asprintf(&path, "%s/tmp.early_stderr.%s", temp_dir, tmp_string());
+	output_init(&early_compiler_err, path);
+	free(path);
+	x_asprintf(&path, "%s/tmp.early.%s.o", temp_dir, tmp_string());
+
+	args_add(args, "-o");
+	args_add(args, path);
+	args_add(args, input_file);
+	gettimeofday(&early_compiler_start, NULL);
+	status = execute_start(args->argv, NULL, 1, &early_compiler);
+	args_pop(args, 3);
+	if (status != 0) {
+		output_free(&early_compiler_out);
+		output_free(&early_compiler_err);
+		unlink(path);
+		free(path);
+		return 0;
+	}
+	early_compiler_obj = path;
+	early_compiler_finished = 0;
+	background_started();
+	return 1;
+}
+
+/*
+ * Start the real compiler before it is known whether the result is in the
+ * cache, so that a miss doesn't have to wait for the preprocessor and the
+ * hashing first. The compiler is stopped if the result is found after all.
+ * It takes a jobserver token like the early preprocessor does.
+ */
+static void start_speculative_compile(ARGS *args)
+{
+	if (direct_i_file || generating_dependencies
+	    || getenv("DEPENDENCIES_OUTPUT") || getenv("SUNPRO_DEPENDENCIES")
+	    || getenv("CCACHE_PREFIX")) {
+		return;
+	}
+	if (!jobserver_acquire(0)) {
+		cc_log("No jobserver token for a speculative compilation");
+		return;
+	}
+	if (!start_early_compiler(args)) {
+		jobserver_release();
+		return;
+	}
+	early_compiler_token = 1;
+	cc_log("Started the compiler speculatively");
+}
+
 /*
   something went badly wrong - just execute the real compiler
 */
@@ -251,6 +617,13 @@ static void failed(void)
 {
 	char *e;
 
+	if (prefetch_only) {
+		prefetch_result("uncacheable");
+	}
+
+	stop_background();
+	release_lease();
+
 	/* delete intermediate pre-processor file if needed */
 	if (i_tmpfile) {
 		if (!direct_i_file) {
@@ -260,9 +633,9 @@ static void failed(void)
 		i_tmpfile = NULL;
 	}
 
-	/* delete the cpp stderr file if necessary */
+	/* delete the cpp stderr if necessary */
 	if (cpp_stderr) {
-		unlink(cpp_stderr);
+		output_free(cpp_stderr);
 		free(cpp_stderr);
 		cpp_stderr = NULL;
 	}
@@ -281,6 +654,7 @@ static void failed(void)
 
 	cc_log("Failed; falling back to running the real compiler");
 	cc_log_executed_command(orig_args->argv);
+	stats_flush();
 	execv(orig_args->argv[0], orig_args->argv);
 	cc_log("execv returned (%s)!", strerror(errno));
 	perror(orig_args->argv[0]);
@@ -294,13 +668,19 @@ static void failed(void)
 static char *get_path_in_cache(const char *name, const char *suffix)
 {
 	int i;
+	int width = shard_width();
 	char *path;
 	char *result;
 
+	/* The first level is the shard, named by the first width digits. */
 	path = x_strdup(cache_dir);
 	for (i = 0; i < nlevels; ++i) {
 		char *p;
-		x_asprintf(&p, "%s/%c", path, name[i]);
+		if (i == 0) {
+			x_asprintf(&p, "%s/%.*s", path, width, name);
+		} else {
+			x_asprintf(&p, "%s/%c", path, name[width + i - 1]);
+		}
 		free(path);
 		path = p;
 		if (create_dir(path) != 0) {
@@ -308,20 +688,65 @@ static char *get_path_in_cache(const char *name, const char *suffix)
 			failed();
 		}
 	}
-	x_asprintf(&result, "%s/%s%s", path, name + nlevels, suffix);
+	x_asprintf(&result, "%s/%s%s", path, name + width + nlevels - 1,
+		   suffix);
 	free(path);
 	return result;
 }
 
+/*
+ * Return the path of the file whose existence tells that the last cache
+ * lookup of this compilation (the same compiler, source file, object file and
+ * working directory) was a miss.
+ */
+static char *miss_marker_path(struct mdfour *common_hash)
+{
+	struct mdfour hash = *common_hash;
+	char *name, *path;
+
+	hash_delimiter(&hash, "missmarker");
+	hash_string(&hash, current_working_dir);
+	hash_string(&hash, input_file);
+	hash_string(&hash, output_obj);
+	name = hash_result(&hash);
+	path = get_path_in_cache(name, ".miss");
+	free(name);
+	return path;
+}
+
+/*
+ * Hash a precompiled header. It isn't source code, so it is hashed by content
+ * only, and the hash is kept in the ccache server like include file hashes.
+ * Returns 0 on failure.
+ */
+static int hash_precompiled_header(const char *path, const struct stat *st,
+				   struct file_hash *result)
+{
+	struct mdfour fhash;
+
+	if (server_file_hash(path, st, result)) {
+		return 1;
+	}
+	hash_start(&fhash);
+	if (!hash_file(&fhash, path)) {
+		return 0;
+	}
+	hash_result_as_bytes(&fhash, result->hash);
+	result->size = fhash.totalN;
+	server_record_file_hash(path, st, result);
+	return 1;
+}
+
 /*
  * This function hashes an include file and stores the path and hash in the
  * global included_files variable. Takes over ownership of path.
  */
 static void remember_include_file(char *path, size_t path_len)
 {
-	struct file_hash *h;
+	struct file_hash *h, known;
 	struct mdfour fhash;
 	struct stat st;
+	time_t mtime;
 	int fd = -1;
 	char *data = (char *)-1;
 	char *source;
@@ -346,6 +771,15 @@ static void remember_include_file(char *path, size_t path_len)
 		goto ignore;
 	}
 
+	if (server_watched_file_hash(path, &known, &mtime)
+	    && ((sloppiness & SLOPPY_INCLUDE_FILE_MTIME)
+		|| mtime < time_of_compilation)) {
+		h = x_malloc(sizeof(*h));
+		*h = known;
+		hashtable_insert(included_files, path, h);
+		return;
+	}
+
 	/* Let's hash the include file. */
 	fd = open(path, O_RDONLY|O_BINARY);
 	if (fd == -1) {
@@ -365,6 +799,24 @@ static void remember_include_file(char *path, size_t path_len)
 		cc_log("Include file %s too new", path);
 		goto failure;
 	}
+	if (is_precompiled_header(path)) {
+		close(fd);
+		fd = -1;
+		h = x_malloc(sizeof(*h));
+		if (!hash_precompiled_header(path, &st, h)) {
+			free(h);
+			goto failure;
+		}
+		hashtable_insert(included_files, path, h);
+		return;
+	}
+	if (server_file_hash(path, &st, &known)) {
+		close(fd);
+		h = x_malloc(sizeof(*h));
+		*h = known;
+		hashtable_insert(included_files, path, h);
+		return;
+	}
 	if (st.st_size > 0) {
 		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 		if (data == (char *)-1) {
@@ -387,6 +839,9 @@ static void remember_include_file(char *path, size_t path_len)
 	h = x_malloc(sizeof(*h));
 	hash_result_as_bytes(&fhash, h->hash);
 	h->size = fhash.totalN;
+	if (result == HASH_SOURCE_CODE_OK) {
+		server_record_file_hash(path, &st, h);
+	}
 	hashtable_insert(included_files, path, h);
 	munmap(data, st.st_size);
 	return;
@@ -517,6 +972,44 @@ static int process_preprocessed_file(struct mdfour *hash, const char *path)
 				free(path);
 			}
 			p = q;
+		} else if (q[0] == '#'
+			   && (q == data || q[-1] == '\n')
+			   && end - q > 28
+			   && strncmp(q, "#pragma GCC pch_preprocess \"", 28) == 0) {
+			/*
+			 * A precompiled header used with -fpch-preprocess. The
+			 * header isn't in the output, so hash its content.
+			 */
+			struct file_hash pch;
+			struct stat st;
+			char *path;
+
+			q += 28;
+			hash_buffer(hash, p, q - p);
+			p = q;
+			while (q < end && *q != '"') {
+				q++;
+			}
+			path = x_strndup(p, q - p);
+			path = make_relative_path(path);
+			hash_string(hash, path);
+			if (stat(path, &st) != 0
+			    || !hash_precompiled_header(path, &st, &pch)) {
+				cc_log("Failed to hash precompiled header %s",
+				       path);
+				free(path);
+				munmap(data, size);
+				return 0;
+			}
+			hash_delimiter(hash, "pch");
+			hash_buffer(hash, pch.hash, sizeof(pch.hash));
+			hash_int(hash, pch.size);
+			if (enable_direct) {
+				remember_include_file(path, q - p);
+			} else {
+				free(path);
+			}
+			p = q;
 		} else {
 			q++;
 		}
@@ -583,107 +1076,114 @@ language_is_preprocessed(const char *language)
 static void to_cache(ARGS *args)
 {
 	char *tmp_stdout, *tmp_stderr, *tmp_obj;
+	struct output out, err;
 	struct stat st;
 	int status;
-	size_t added_bytes = 0;
+	uint64_t added_bytes = 0;
 	unsigned added_files = 0;
+	struct timeval start, end;
+	char *dir;
+	uint64_t store_start;
+
+	if (early_compiler_obj) {
+		/* the compiler has been running since before the lookup */
+		if (!early_compiler_finished) {
+			cc_log("Waiting for the compiler started early");
+			finish_early_compiler();
+		}
+		out = early_compiler_out;
+		err = early_compiler_err;
+		tmp_obj = early_compiler_obj;
+		early_compiler_obj = NULL;
+		start = early_compiler_start;
+		end = early_compiler_end;
+		status = early_compiler_status;
+
+		/* it compiled the source file, so it has reported this itself */
+		if (cpp_stderr) {
+			output_free(cpp_stderr);
+			free(cpp_stderr);
+			cpp_stderr = NULL;
+		}
+	} else {
+		x_asprintf(&tmp_stdout, "%s.tmp.stdout.%s", cached_obj,
+			   tmp_string());
+		x_asprintf(&tmp_stderr, "%s.tmp.stderr.%s", cached_obj,
+			   tmp_string());
+		x_asprintf(&tmp_obj, "%s.tmp.%s", cached_obj, tmp_string());
+		output_init(&out, tmp_stdout);
+		output_init(&err, tmp_stderr);
+		free(tmp_stdout);
+		free(tmp_stderr);
+
+		args_add(args, "-o");
+		args_add(args, tmp_obj);
+
+		/* Turn off DEPENDENCIES_OUTPUT when running cc1, because
+		 * otherwise it will emit a line like
+		 *
+		 *  tmp.stdout.vexed.732.o: /home/mbp/.ccache/tmp.stdout.vexed.732.i
+		 *
+		 * unsetenv() is on BSD and Linux but not portable. */
+		putenv("DEPENDENCIES_OUTPUT");
 
-	x_asprintf(&tmp_stdout, "%s.tmp.stdout.%s", cached_obj, tmp_string());
-	x_asprintf(&tmp_stderr, "%s.tmp.stderr.%s", cached_obj, tmp_string());
-	x_asprintf(&tmp_obj, "%s.tmp.%s", cached_obj, tmp_string());
-
-	args_add(args, "-o");
-	args_add(args, tmp_obj);
-
-	/* Turn off DEPENDENCIES_OUTPUT when running cc1, because
-	 * otherwise it will emit a line like
-	 *
-	 *  tmp.stdout.vexed.732.o: /home/mbp/.ccache/tmp.stdout.vexed.732.i
-	 *
-	 * unsetenv() is on BSD and Linux but not portable. */
-	putenv("DEPENDENCIES_OUTPUT");
+		if (compile_preprocessed_source_code) {
+			args_add(args, i_tmpfile);
+		} else {
+			args_add(args, input_file);
+		}
 
-	if (compile_preprocessed_source_code) {
-		args_add(args, i_tmpfile);
-	} else {
-		args_add(args, input_file);
+		cc_log("Running real compiler");
+		gettimeofday(&start, NULL);
+		status = execute(args->argv, NULL, &out, &err);
+		gettimeofday(&end, NULL);
+		args_pop(args, 3);
 	}
+	stats_latency(PHASE_COMPILER,
+		      (uint64_t)start.tv_sec * 1000000 + start.tv_usec);
+	store_start = stats_timer();
 
-	cc_log("Running real compiler");
-	status = execute(args->argv, tmp_stdout, tmp_stderr);
-	args_pop(args, 3);
-
-	if (stat(tmp_stdout, &st) != 0 || st.st_size != 0) {
+	if (out.size != 0) {
 		cc_log("Compiler produced stdout");
 		stats_update(STATS_STDOUT);
-		unlink(tmp_stdout);
-		unlink(tmp_stderr);
+		output_free(&out);
+		output_free(&err);
 		unlink(tmp_obj);
 		failed();
 	}
-	unlink(tmp_stdout);
+	output_free(&out);
 
 	/*
 	 * Merge stderr from the preprocessor (if any) and stderr from the real
-	 * compiler into tmp_stderr.
+	 * compiler.
 	 */
 	if (cpp_stderr) {
-		int fd_cpp_stderr;
-		int fd_real_stderr;
-		int fd_result;
-
-		fd_cpp_stderr = open(cpp_stderr, O_RDONLY | O_BINARY);
-		if (fd_cpp_stderr == -1) {
-			cc_log("Failed opening %s", cpp_stderr);
-			failed();
-		}
-		fd_real_stderr = open(tmp_stderr, O_RDONLY | O_BINARY);
-		if (fd_real_stderr == -1) {
-			cc_log("Failed opening %s", tmp_stderr);
-			failed();
-		}
-		unlink(tmp_stderr);
-		fd_result = open(tmp_stderr,
-				 O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
-				 0666);
-		if (fd_result == -1) {
-			cc_log("Failed opening %s", tmp_stderr);
-			failed();
-		}
-		copy_fd(fd_cpp_stderr, fd_result);
-		copy_fd(fd_real_stderr, fd_result);
-		close(fd_cpp_stderr);
-		close(fd_real_stderr);
-		close(fd_result);
-		unlink(cpp_stderr);
+		output_append_output(cpp_stderr, &err);
+		output_free(&err);
+		err = *cpp_stderr;
 		free(cpp_stderr);
 		cpp_stderr = NULL;
 	}
 
 	if (status != 0) {
-		int fd;
 		cc_log("Compiler gave exit status %d", status);
 		stats_update(STATS_STATUS);
 
-		fd = open(tmp_stderr, O_RDONLY | O_BINARY);
-		if (fd != -1) {
-			if (strcmp(output_obj, "/dev/null") == 0
-			    || (access(tmp_obj, R_OK) == 0
-			        && move_file(tmp_obj, output_obj, 0) == 0)
-			    || errno == ENOENT) {
-				/* we can use a quick method of
-				   getting the failed output */
-				copy_fd(fd, 2);
-				close(fd);
-				unlink(tmp_stderr);
-				if (i_tmpfile && !direct_i_file) {
-					unlink(i_tmpfile);
-				}
-				exit(status);
+		if (strcmp(output_obj, "/dev/null") == 0
+		    || (access(tmp_obj, R_OK) == 0
+		        && move_file(tmp_obj, output_obj, 0) == 0)
+		    || errno == ENOENT) {
+			/* we can use a quick method of
+			   getting the failed output */
+			output_copy_to_fd(&err, 2);
+			output_free(&err);
+			if (i_tmpfile && !direct_i_file) {
+				unlink(i_tmpfile);
 			}
+			exit(status);
 		}
 
-		unlink(tmp_stderr);
+		output_free(&err);
 		unlink(tmp_obj);
 		failed();
 	}
@@ -691,36 +1191,29 @@ static void to_cache(ARGS *args)
 	if (stat(tmp_obj, &st) != 0) {
 		cc_log("Compiler didn't produce an object file");
 		stats_update(STATS_NOOUTPUT);
+		output_free(&err);
 		failed();
 	}
 	if (st.st_size == 0) {
 		cc_log("Compiler produced an empty object file");
 		stats_update(STATS_EMPTYOUTPUT);
+		output_free(&err);
 		failed();
 	}
 
-	if (stat(tmp_stderr, &st) != 0) {
-		cc_log("Failed to stat %s", tmp_stderr);
-		stats_update(STATS_ERROR);
-		failed();
-	}
-	if (st.st_size > 0) {
-		if (move_uncompressed_file(tmp_stderr, cached_stderr,
-		                           enable_compression) != 0) {
-			cc_log("Failed to move %s to %s",
-			       tmp_stderr, cached_stderr);
+	if (err.size > 0) {
+		if (output_save(&err, cached_stderr, enable_compression) != 0
+		    || stat(cached_stderr, &st) != 0) {
+			cc_log("Failed to store %s", cached_stderr);
 			stats_update(STATS_ERROR);
+			output_free(&err);
 			failed();
 		}
 		cc_log("Stored in cache: %s", cached_stderr);
-		if (enable_compression) {
-			stat(cached_stderr, &st);
-		}
 		added_bytes += file_size(&st);
 		added_files += 1;
-	} else {
-		unlink(tmp_stderr);
 	}
+	output_free(&err);
 	if (move_uncompressed_file(tmp_obj, cached_obj, enable_compression) != 0) {
 		cc_log("Failed to move %s to %s", tmp_obj, cached_obj);
 		stats_update(STATS_ERROR);
@@ -742,11 +1235,17 @@ static void to_cache(ARGS *args)
 		failed();
 	}
 
-	stats_update_size(STATS_TOCACHE, added_bytes / 1024, added_files);
+	dir = dirname(stats_file);
+	record_compile_cost(dir, cached_obj,
+			    (end.tv_sec - start.tv_sec) * 1000
+			    + (end.tv_usec - start.tv_usec) / 1000,
+			    added_bytes);
+	free(dir);
+
+	stats_update_size(STATS_TOCACHE, added_bytes, added_files);
+	stats_latency(PHASE_STORE, store_start);
 
 	free(tmp_obj);
-	free(tmp_stderr);
-	free(tmp_stdout);
 }
 
 /*
@@ -756,49 +1255,45 @@ static void to_cache(ARGS *args)
 static struct file_hash *
 get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 {
-	char *input_base;
-	char *tmp;
 	char *path_stdout, *path_stderr;
+	struct output *err;
 	int status;
 	struct file_hash *result;
+	uint64_t start;
 
-	/* ~/hello.c -> tmp.hello.123.i
-	   limit the basename to 10
-	   characters in order to cope with filesystem with small
-	   maximum filename length limits */
-	input_base = basename(input_file);
-	tmp = strchr(input_base, '.');
-	if (tmp != NULL) {
-		*tmp = 0;
-	}
-	if (strlen(input_base) > 10) {
-		input_base[10] = 0;
-	}
-
-	/* now the run */
-	x_asprintf(&path_stdout, "%s/%s.tmp.%s.%s", temp_dir,
-		   input_base, tmp_string(), i_extension);
 	x_asprintf(&path_stderr, "%s/tmp.cpp_stderr.%s", temp_dir,
 		   tmp_string());
+	err = x_malloc(sizeof(*err));
+	output_init(err, path_stderr);
+	free(path_stderr);
+
+	if (early_cpp_stdout) {
+		/* the preprocessor is already running */
+		cc_log("Waiting for the early preprocessor");
+		start = stats_timer();
+		status = execute_finish(&early_cpp, NULL, err);
+		stats_latency(PHASE_PREPROCESSOR, start);
+		path_stdout = early_cpp_stdout;
+		early_cpp_stdout = NULL;
+		background_done();
+		jobserver_release();
+	} else if (!direct_i_file) {
+		path_stdout = preprocessed_path();
+		time_of_compilation = time(NULL);
 
-	time_of_compilation = time(NULL);
-
-	if (!direct_i_file) {
 		/* run cpp on the input file to obtain the .i */
 		args_add(args, "-E");
 		args_add(args, input_file);
-		status = execute(args->argv, path_stdout, path_stderr);
+		start = stats_timer();
+		status = execute(args->argv, path_stdout, NULL, err);
+		stats_latency(PHASE_PREPROCESSOR, start);
 		args_pop(args, 2);
 	} else {
 		/* we are compiling a .i or .ii file - that means we
 		   can skip the cpp stage and directly form the
 		   correct i_tmpfile */
+		time_of_compilation = time(NULL);
 		path_stdout = input_file;
-		if (create_empty_file(path_stderr) != 0) {
-			stats_update(STATS_ERROR);
-			cc_log("Failed to create %s", path_stderr);
-			failed();
-		}
 		status = 0;
 	}
 
@@ -806,12 +1301,13 @@ get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 		if (!direct_i_file) {
 			unlink(path_stdout);
 		}
-		unlink(path_stderr);
+		output_free(err);
 		cc_log("Preprocessor gave exit status %d", status);
 		stats_update(STATS_PREPROCESSOR);
 		failed();
 	}
 
+	start = stats_timer();
 	if (enable_unify) {
 		/*
 		 * When we are doing the unifying tricks we need to include the
@@ -823,7 +1319,7 @@ get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 		hash_delimiter(hash, "unifycpp");
 		if (unify_hash(hash, path_stdout) != 0) {
 			stats_update(STATS_ERROR);
-			unlink(path_stderr);
+			output_free(err);
 			cc_log("Failed to unify %s", path_stdout);
 			failed();
 		}
@@ -831,15 +1327,16 @@ get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 		hash_delimiter(hash, "cpp");
 		if (!process_preprocessed_file(hash, path_stdout)) {
 			stats_update(STATS_ERROR);
-			unlink(path_stderr);
+			output_free(err);
 			failed();
 		}
 	}
 
 	hash_delimiter(hash, "cppstderr");
-	if (!hash_file(hash, path_stderr)) {
-		fatal("Failed to open %s", path_stderr);
+	if (!output_hash(hash, err)) {
+		fatal("Failed to read %s", err->spill_path);
 	}
+	stats_latency(PHASE_CPP_HASH, start);
 
 	i_tmpfile = path_stdout;
 
@@ -849,10 +1346,10 @@ get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 		 * stderr data and output it just before the main stderr from
 		 * the compiler pass.
 		 */
-		cpp_stderr = path_stderr;
+		cpp_stderr = err;
 	} else {
-		unlink(path_stderr);
-		free(path_stderr);
+		output_free(err);
+		free(err);
 	}
 
 	result = x_malloc(sizeof(*result));
@@ -861,6 +1358,144 @@ get_object_name_from_cpp(ARGS *args, struct mdfour *hash)
 	return result;
 }
 
+/*
+ * Hash the files that a dependency file written by the compiler (-MD) lists
+ * as prerequisites and remember them as included files. Returns 0 if the
+ * dependency file couldn't be read or an included file can't be used in
+ * direct mode.
+ */
+static int hash_dependency_file(struct mdfour *hash, const char *path)
+{
+	int fd;
+	char *data, *word;
+	char *p, *end;
+	size_t len;
+	struct stat st;
+	struct file_hash *h;
+	char *include;
+	int in_targets = 1;
+
+	fd = open(path, O_RDONLY|O_BINARY);
+	if (fd == -1) {
+		cc_log("Failed to open %s", path);
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		cc_log("Failed to fstat %s", path);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == (void *)-1) {
+		cc_log("Failed to mmap %s", path);
+		return 0;
+	}
+
+	word = x_malloc(st.st_size + 1);
+	p = data;
+	end = data + st.st_size;
+	while (p < end && enable_direct) {
+		/* An unescaped newline ends a rule like "x.o: x.c x.h". */
+		if (*p == '\n') {
+			in_targets = 1;
+			p++;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+			continue;
+		}
+		if (*p == '\\' && p + 1 < end
+		    && (p[1] == '\n' || p[1] == '\r')) {
+			p += 2;
+			continue;
+		}
+
+		/* Unescape "\ ", "\#" and "$$" as make does. */
+		len = 0;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\n'
+		       && *p != '\r') {
+			if (*p == '\\' && p + 1 < end
+			    && (p[1] == ' ' || p[1] == '#')) {
+				p++;
+			} else if (*p == '\\' && p + 1 < end
+				   && (p[1] == '\n' || p[1] == '\r')) {
+				break;
+			} else if (*p == '$' && p + 1 < end && p[1] == '$') {
+				p++;
+			}
+			word[len++] = *p++;
+		}
+		word[len] = 0;
+
+		if (in_targets) {
+			/* The targets end with a colon. */
+			if (len > 0 && word[len - 1] == ':') {
+				in_targets = 0;
+			}
+			continue;
+		}
+
+		include = make_relative_path(x_strdup(word));
+		hash_delimiter(hash, "include");
+		hash_string(hash, include);
+		remember_include_file(x_strdup(include), strlen(include));
+		h = hashtable_search(included_files, include);
+		if (h) {
+			hash_buffer(hash, h->hash, sizeof(h->hash));
+			hash_int(hash, h->size);
+		}
+		free(include);
+	}
+
+	free(word);
+	munmap(data, st.st_size);
+	return enable_direct;
+}
+
+/*
+ * Depend mode: compile the source file right away and take the included
+ * files from the dependency file that the compiler writes, saving the
+ * preprocessor run. The object hash is formed from the direct mode hash and
+ * the included files. Returns the object hash, or NULL if the included files
+ * can't be used, in which case the preprocessor is run as usual and
+ * to_cache() takes over the result of the compilation. A failed compilation
+ * is reported right away.
+ */
+static struct file_hash *
+get_object_name_from_dependencies(ARGS *args)
+{
+	struct mdfour hash = depend_mode_hash;
+	struct file_hash *result;
+	uint64_t start;
+
+	time_of_compilation = time(NULL);
+	cc_log("Running real compiler in depend mode");
+	if (!start_early_compiler(args)) {
+		return NULL;
+	}
+	finish_early_compiler();
+	if (early_compiler_status != 0) {
+		to_cache(args);
+	}
+
+	start = stats_timer();
+	included_files = create_hashtable(1000, hash_from_string,
+					  strings_equal);
+	hash_delimiter(&hash, "dependencies");
+	if (!hash_dependency_file(&hash, output_dep)) {
+		cc_log("Failed to use the included files in %s", output_dep);
+		return NULL;
+	}
+	stats_latency(PHASE_CPP_HASH, start);
+
+	result = x_malloc(sizeof(*result));
+	hash_result_as_bytes(&hash, result->hash);
+	result->size = hash.totalN;
+	return result;
+}
+
 static void update_cached_result_globals(struct file_hash *hash)
 {
 	char *object_name;
@@ -870,7 +1505,8 @@ static void update_cached_result_globals(struct file_hash *hash)
 	cached_obj = get_path_in_cache(object_name, ".o");
 	cached_stderr = get_path_in_cache(object_name, ".stderr");
 	cached_dep = get_path_in_cache(object_name, ".d");
-	x_asprintf(&stats_file, "%s/%c/stats", cache_dir, object_name[0]);
+	x_asprintf(&stats_file, "%s/%.*s/stats", cache_dir, shard_width(),
+		   object_name);
 	free(object_name);
 }
 
@@ -1048,6 +1684,7 @@ static struct file_hash *calculate_object_hash(
 			enable_direct = 0;
 			return NULL;
 		}
+		depend_mode_hash = *hash;
 		manifest_name = hash_result(hash);
 		manifest_path = get_path_in_cache(manifest_name, ".manifest");
 		free(manifest_name);
@@ -1080,6 +1717,7 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 	int ret;
 	struct stat st;
 	int produce_dep_file;
+	uint64_t start;
 
 	/* the user might be disabling cache hits */
 	if (mode != FROMCACHE_COMPILED_MODE && getenv("CCACHE_RECACHE")) {
@@ -1105,6 +1743,11 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 		return;
 	}
 
+	stop_background();
+	if (miss_marker_exists && mode != FROMCACHE_COMPILED_MODE) {
+		unlink(miss_marker);
+	}
+	start = stats_timer();
 	if (strcmp(output_obj, "/dev/null") == 0) {
 		ret = 0;
 	} else {
@@ -1175,12 +1818,22 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 		}
 	}
 
-	/* Update modification timestamps to save files from LRU cleanup.
-	   Also gives files a sensible mtime when hard-linking. */
-	update_mtime(cached_obj);
-	update_mtime(cached_stderr);
-	if (produce_dep_file) {
-		update_mtime(cached_dep);
+	if (getenv("CCACHE_HARDLINK")) {
+		/* Give hard-linked output files a sensible mtime. */
+		update_mtime(cached_obj);
+		update_mtime(cached_stderr);
+		if (produce_dep_file) {
+			update_mtime(cached_dep);
+		}
+	}
+
+	/* Log the hit to save the files from LRU cleanup. This is cheaper
+	   than updating their modification timestamps. */
+	if (mode != FROMCACHE_COMPILED_MODE && !getenv("CCACHE_READONLY")) {
+		record_access(cached_obj);
+		if (mode == FROMCACHE_DIRECT_MODE) {
+			record_access(manifest_path);
+		}
 	}
 
 	if (generating_dependencies && mode != FROMCACHE_DIRECT_MODE) {
@@ -1192,7 +1845,7 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 		} else {
 			cc_log("Stored in cache: %s", cached_dep);
 			stat(cached_dep, &st);
-			stats_update_size(STATS_NONE, file_size(&st) / 1024, 1);
+			stats_update_size(STATS_NONE, file_size(&st), 1);
 		}
 	}
 
@@ -1205,9 +1858,9 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 		i_tmpfile = NULL;
 	}
 
-	/* Delete the cpp stderr file if necessary. */
+	/* Delete the cpp stderr if necessary. */
 	if (cpp_stderr) {
-		unlink(cpp_stderr);
+		output_free(cpp_stderr);
 		free(cpp_stderr);
 		cpp_stderr = NULL;
 	}
@@ -1218,6 +1871,7 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 		copy_fd(fd_stderr, 2);
 		close(fd_stderr);
 	}
+	stats_latency(PHASE_COPY_OUT, start);
 
 	/* Create or update the manifest file. */
 	if (enable_direct
@@ -1225,7 +1879,8 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 	    && included_files
 	    && !getenv("CCACHE_READONLY")) {
 		struct stat st;
-		size_t old_size = 0; /* in bytes */
+		uint64_t old_size = 0; /* in bytes */
+		start = stats_timer();
 		if (stat(manifest_path, &st) == 0) {
 			old_size = file_size(&st);
 		}
@@ -1235,11 +1890,12 @@ static void from_cache(enum fromcache_call_mode mode, int put_object_in_manifest
 			stat(manifest_path, &st);
 			stats_update_size(
 				STATS_NONE,
-				(file_size(&st) - old_size) / 1024,
+				(int64_t)file_size(&st) - (int64_t)old_size,
 				old_size == 0 ? 1 : 0);
 		} else {
 			cc_log("Failed to add object file hash to %s", manifest_path);
 		}
+		stats_latency(PHASE_MANIFEST_UPDATE, start);
 	}
 
 	/* log the cache hit */
@@ -1305,6 +1961,23 @@ static void find_compiler(int argc, char **argv)
 	orig_args->argv[0] = compiler;
 }
 
+/*
+ * Note whether a header given with -include has a precompiled header next to
+ * it, which the compiler uses instead of the header.
+ */
+static void detect_precompiled_header(const char *path)
+{
+	char *pch;
+	struct stat st;
+
+	x_asprintf(&pch, "%s.gch", path);
+	if (stat(pch, &st) == 0) {
+		cc_log("Detected use of precompiled header %s", pch);
+		using_precompiled_header = 1;
+	}
+	free(pch);
+}
+
 /*
    process the compiler options to form the correct set of options
    for obtaining the preprocessor output
@@ -1326,6 +1999,38 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 	/* is the dependency makefile target name specified with -MT or -MQ? */
 	int dependency_target_specified = 0;
 	ARGS *stripped_args;
+	ARGS *expanded_args, *file_args;
+	int expansions = 0;
+
+	/*
+	 * Expand response files (@file) first so that their arguments are
+	 * classified and hashed like any other. The expanded list is kept
+	 * since globals like output_obj point into it.
+	 */
+	expanded_args = args_init(argc, argv);
+	for (i = 1; i < expanded_args->argc; ) {
+		if (expanded_args->argv[i][0] != '@') {
+			i++;
+			continue;
+		}
+		if (++expansions > 100) {
+			cc_log("Too many response files (recursive @file?)");
+			stats_update(STATS_ARGS);
+			failed();
+		}
+		file_args = args_init_from_gcc_atfile(expanded_args->argv[i] + 1);
+		if (!file_args) {
+			cc_log("Couldn't read response file %s",
+			       expanded_args->argv[i] + 1);
+			stats_update(STATS_ARGS);
+			failed();
+		}
+		cc_log("Expanded response file %s", expanded_args->argv[i] + 1);
+		/* Nested response files are expanded in the next rounds. */
+		args_insert(expanded_args, i, file_args, 1);
+	}
+	argc = expanded_args->argc;
+	argv = expanded_args->argv;
 
 	stripped_args = args_init(0, NULL);
 
@@ -1340,8 +2045,7 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 		}
 
 		/* these are too hard */
-		if (strncmp(argv[i], "@", 1) == 0 ||
-		    strcmp(argv[i], "--coverage") == 0 ||
+		if (strcmp(argv[i], "--coverage") == 0 ||
 		    strcmp(argv[i], "-M") == 0 ||
 		    strcmp(argv[i], "-MM") == 0 ||
 		    strcmp(argv[i], "-fbranch-probabilities") == 0 ||
@@ -1471,6 +2175,9 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 		if (strcmp(argv[i], "-MD") == 0
 		    || strcmp(argv[i], "-MMD") == 0) {
 			generating_dependencies = 1;
+			if (argv[i][2] == 'D') {
+				generating_system_dependencies = 1;
+			}
 		}
 		if (i < argc - 1) {
 			if (strcmp(argv[i], "-MF") == 0) {
@@ -1487,6 +2194,7 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 			if (strncmp(argv[i], "-Wp,-MD,", 8) == 0
 			    && !strchr(argv[i] + 8, ',')) {
 				generating_dependencies = 1;
+				generating_system_dependencies = 1;
 				dependency_filename_specified = 1;
 				output_dep = make_relative_path(
 					x_strdup(argv[i] + 8));
@@ -1539,6 +2247,9 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 					args_add(stripped_args, argv[i]);
 					relpath = make_relative_path(x_strdup(argv[i+1]));
 					args_add(stripped_args, relpath);
+					if (strcmp(argv[i], "-include") == 0) {
+						detect_precompiled_header(relpath);
+					}
 					free(relpath);
 					i++;
 					break;
@@ -1691,7 +2402,15 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 		i_extension = i_extension_for_language(actual_language) + 1;
 	}
 
-	if (!found_c_opt) {
+	output_is_precompiled_header =
+		strstr(actual_language, "-header") != NULL
+		|| (output_obj && is_precompiled_header(output_obj));
+	if (output_is_precompiled_header) {
+		/* the preprocessed header would be compiled into an object */
+		compile_preprocessed_source_code = 0;
+	}
+
+	if (!found_c_opt && !output_is_precompiled_header) {
 		cc_log("No -c option found");
 		/* I find that having a separate statistic for autoconf tests is useful,
 		   as they are the dominant form of "called for link" in many cases */
@@ -1710,7 +2429,10 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 		failed();
 	}
 
-	if (!output_obj) {
+	if (!output_obj && output_is_precompiled_header) {
+		/* next to the header, like the compiler does */
+		x_asprintf(&output_obj, "%s.gch", input_file);
+	} else if (!output_obj) {
 		char *p;
 		output_obj = x_strdup(input_file);
 		if ((p = strrchr(output_obj, '/'))) {
@@ -1726,6 +2448,15 @@ static void process_args(int argc, char **argv, ARGS **preprocessor_args,
 		p[2] = 0;
 	}
 
+	/*
+	 * Let the preprocessor name the precompiled header that the compiler
+	 * will use instead of expanding the header, so that it gets hashed.
+	 */
+	if (using_precompiled_header) {
+		args_strip(stripped_args, "-fpch-preprocess");
+		args_add(stripped_args, "-fpch-preprocess");
+	}
+
 	/* If dependencies are generated, configure the preprocessor */
 
 	if (generating_dependencies) {
@@ -1816,6 +2547,177 @@ static unsigned parse_sloppiness(char *p)
 	return result;
 }
 
+/* Read a file so that it's in the page cache. Returns 0 if it's missing. */
+static int read_into_page_cache(const char *path)
+{
+	char buf[65536];
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return 0;
+	}
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		/* Discard. */
+	}
+	close(fd);
+	return 1;
+}
+
+/*
+ * Predict whether the compilation would be a direct mode hit, reading the
+ * manifest, the include files and the cached result on the way.
+ */
+static void prefetch(ARGS *preprocessor_args, struct mdfour *hash)
+{
+	struct file_hash *object_hash;
+
+	if (!enable_direct) {
+		prefetch_result("unknown");
+	}
+	object_hash = calculate_object_hash(preprocessor_args, hash, 1);
+	if (!object_hash) {
+		prefetch_result("miss");
+	}
+	update_cached_result_globals(object_hash);
+	if (!read_into_page_cache(cached_obj)) {
+		prefetch_result("miss");
+	}
+	read_into_page_cache(cached_stderr);
+	read_into_page_cache(cached_dep);
+	prefetch_result("hit");
+}
+
+/*
+ * Return whether the holder of a lease may still be compiling. The lease
+ * contains the hostname and pid of the holder.
+ */
+static int lease_is_live(const char *path, time_t timeout)
+{
+	char buf[300], *pid_start;
+	struct stat st;
+	ssize_t n;
+	long pid;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (st.st_mtime + timeout < time(NULL)) {
+		cc_log("Lease %s has expired", path);
+		return 0;
+	}
+	if (n <= 0) {
+		/* Not written yet. */
+		return 1;
+	}
+	buf[n] = '\0';
+	pid_start = strrchr(buf, ' ');
+	if (!pid_start) {
+		return 1;
+	}
+	*pid_start = '\0';
+	pid = atol(pid_start + 1);
+	if (strcmp(buf, get_hostname()) == 0
+	    && kill((pid_t)pid, 0) == -1 && errno == ESRCH) {
+		cc_log("Holder of lease %s has died", path);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Get the lease for compiling the object. If another process holds it, wait
+ * for that process to finish and return 0 so that the result can be taken
+ * from the cache; otherwise return 1.
+ */
+static int acquire_lease(time_t timeout)
+{
+	char *path, *content;
+	time_t deadline = time(NULL) + timeout;
+	useconds_t delay = 1000;
+	int fd;
+
+	x_asprintf(&path, "%s.tmp.lease", cached_obj);
+	while (1) {
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+		if (fd != -1) {
+			x_asprintf(&content, "%s %ld\n",
+				   get_hostname(), (long)getpid());
+			if (write(fd, content, strlen(content)) == -1) {
+				/* Then it looks unwritten until it expires. */
+			}
+			close(fd);
+			free(content);
+			lease_path = path;
+			atexit(release_lease);
+			return 1;
+		}
+		if (errno != EEXIST) {
+			cc_log("Failed to create lease %s (%s)",
+			       path, strerror(errno));
+			free(path);
+			return 1;
+		}
+		if (!lease_is_live(path, timeout)) {
+			unlink(path);
+			continue;
+		}
+
+		cc_log("Waiting for the holder of lease %s", path);
+		while (access(path, F_OK) == 0) {
+			if (time(NULL) >= deadline) {
+				cc_log("Gave up waiting for lease %s", path);
+				free(path);
+				return 1;
+			}
+			usleep(delay);
+			if (delay < 100000) {
+				delay *= 2;
+			} else if (!lease_is_live(path, timeout)) {
+				break;
+			}
+		}
+		if (access(path, F_OK) != 0) {
+			free(path);
+			return 0;
+		}
+	}
+}
+
+/*
+ * Run the real compiler, or take over the result of the compiler started
+ * early, store the result in the cache and return it.
+ */
+static void store_compiled_result(ARGS *args, int put_object_in_manifest)
+{
+	/* predict a miss the next time too */
+	if (miss_marker && !miss_marker_exists) {
+		int fd = open(miss_marker, O_WRONLY|O_CREAT|O_BINARY, 0666);
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	/* run real compiler, sending output to cache */
+	to_cache(args);
+
+	/* return from cache */
+	from_cache(FROMCACHE_COMPILED_MODE, put_object_in_manifest);
+
+	/* oh oh! */
+	cc_log("Secondary from_cache failed");
+	stats_update(STATS_ERROR);
+	failed();
+}
+
 /* the main ccache driver function */
 static void ccache(int argc, char *argv[])
 {
@@ -1823,9 +2725,11 @@ static void ccache(int argc, char *argv[])
 	struct file_hash *object_hash;
 	struct file_hash *object_hash_from_manifest = NULL;
 	char *env;
+	time_t lease_timeout;
 	struct mdfour common_hash;
 	struct mdfour direct_hash;
 	struct mdfour cpp_hash;
+	uint64_t start;
 
 	/* Arguments (except -E) to send to the preprocessor. */
 	ARGS *preprocessor_args;
@@ -1839,6 +2743,9 @@ static void ccache(int argc, char *argv[])
 
 	cc_log("Hostname: %s", get_hostname());
 	cc_log("Working directory: %s", current_working_dir);
+	if (in_server()) {
+		cc_log("Running in the ccache server");
+	}
 
 	if (base_dir) {
 		cc_log("Base directory: %s", base_dir);
@@ -1885,15 +2792,32 @@ static void ccache(int argc, char *argv[])
 	}
 	cc_log("Object file: %s", output_obj);
 
+	start = stats_timer();
 	hash_start(&common_hash);
 	calculate_common_hash(preprocessor_args, &common_hash);
+	stats_latency(PHASE_COMMON_HASH, start);
 
 	/* try to find the hash using the manifest */
 	direct_hash = common_hash;
+	if (prefetch_only) {
+		prefetch(preprocessor_args, &direct_hash);
+	}
+	if (getenv("CCACHE_SPECULATE") && !getenv("CCACHE_READONLY")) {
+		miss_marker = miss_marker_path(&common_hash);
+		miss_marker_exists = access(miss_marker, F_OK) == 0;
+		if (miss_marker_exists) {
+			start_speculative_compile(preprocessor_args);
+		}
+	}
 	if (enable_direct) {
+		if (getenv("CCACHE_EARLYCPP")) {
+			start_early_cpp(preprocessor_args);
+		}
 		cc_log("Trying direct lookup");
+		start = stats_timer();
 		object_hash = calculate_object_hash(
 			preprocessor_args, &direct_hash, 1);
+		stats_latency(PHASE_DIRECT_LOOKUP, start);
 		if (object_hash) {
 			update_cached_result_globals(object_hash);
 
@@ -1917,6 +2841,24 @@ static void ccache(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 * In depend mode, a direct mode miss is compiled right away, taking the
+	 * included files from the dependency file instead of the preprocessor.
+	 * This needs -MD since -MMD leaves out the system headers, and the
+	 * dependency file doesn't list precompiled headers.
+	 */
+	if (getenv("CCACHE_DEPEND") && enable_direct && !direct_i_file
+	    && generating_system_dependencies && !early_compiler_obj
+	    && !using_precompiled_header
+	    && !getenv("CCACHE_READONLY") && !getenv("CCACHE_PREFIX")) {
+		object_hash = get_object_name_from_dependencies(
+			preprocessor_args);
+		if (object_hash) {
+			update_cached_result_globals(object_hash);
+			store_compiled_result(compiler_args, 1);
+		}
+	}
+
 	/*
 	 * Find the hash using the preprocessed output. Also updates
 	 * included_files.
@@ -1962,6 +2904,17 @@ static void ccache(int argc, char *argv[])
 		failed();
 	}
 
+	/*
+	 * If another process is compiling the same object, wait for it and use
+	 * its result.
+	 */
+	env = getenv("CCACHE_LEASETIMEOUT");
+	lease_timeout = env ? atoi(env) : 0;
+	if (lease_timeout > 0 && !acquire_lease(lease_timeout)) {
+		from_cache(FROMCACHE_CPP_MODE, put_object_in_manifest);
+		cc_log("No result from the holder of the lease; compiling");
+	}
+
 	env = getenv("CCACHE_PREFIX");
 	if (env) {
 		char *p = find_executable(env, MYNAME);
@@ -1973,16 +2926,7 @@ static void ccache(int argc, char *argv[])
 		args_add_prefix(compiler_args, p);
 	}
 
-	/* run real compiler, sending output to cache */
-	to_cache(compiler_args);
-
-	/* return from cache */
-	from_cache(FROMCACHE_COMPILED_MODE, put_object_in_manifest);
-
-	/* oh oh! */
-	cc_log("Secondary from_cache failed");
-	stats_update(STATS_ERROR);
-	failed();
+	store_compiled_result(compiler_args, put_object_in_manifest);
 }
 
 static void check_cache_dir(void)
@@ -1992,16 +2936,40 @@ static void check_cache_dir(void)
 	}
 }
 
+int main(int argc, char *argv[]);
+
+/* main() for the workers of --prefetch */
+static int prefetch_main(int argc, char *argv[])
+{
+	prefetch_only = 1;
+	return main(argc, argv);
+}
+
 /* the main program when not doing a compile */
 static int ccache_main(int argc, char *argv[])
 {
 	int c;
-	size_t v;
+	uint64_t v;
+	int cleanup = 0;
+	int background = 0;
+	int print_stats = 0;
+	const char *format = "json";
+	const char *batch_file = NULL;
+	const char *prefetch_file = NULL;
+	int jobs = 0;
 
 	static const struct option long_options[] = {
 		{"show-stats", no_argument,       0, 's'},
+		{"show-latency", no_argument,     0, 'L'},
+		{"print-stats", no_argument,      0, 'P'},
+		{"server",     no_argument,       0, 'S'},
+		{"batch",      required_argument, 0, 'B'},
+		{"jobs",       required_argument, 0, 'j'},
+		{"prefetch",   required_argument, 0, 'p'},
+		{"format",     required_argument, 0, 'f'},
 		{"zero-stats", no_argument,       0, 'z'},
 		{"cleanup",    no_argument,       0, 'c'},
+		{"background", no_argument,       0, 'b'},
 		{"clear",      no_argument,       0, 'C'},
 		{"max-files",  required_argument, 0, 'F'},
 		{"max-size",   required_argument, 0, 'M'},
@@ -2011,7 +2979,7 @@ static int ccache_main(int argc, char *argv[])
 	};
 	int option_index = 0;
 
-	while ((c = getopt_long(argc, argv, "hszcCF:M:V", long_options, &option_index)) != -1) {
+	while ((c = getopt_long(argc, argv, "hszcCF:M:Vj:", long_options, &option_index)) != -1) {
 		switch (c) {
 		case 'V':
 			fprintf(stdout, VERSION_TEXT, CCACHE_VERSION);
@@ -2026,10 +2994,53 @@ static int ccache_main(int argc, char *argv[])
 			stats_summary();
 			break;
 
+		case 'L':
+			check_cache_dir();
+			stats_latency_summary();
+			break;
+
+		case 'P':
+			/* Done below since --format may come later. */
+			check_cache_dir();
+			print_stats = 1;
+			break;
+
+		case 'f':
+			format = optarg;
+			break;
+
+		case 'S':
+			if (!getenv("CCACHE_SERVER")) {
+				fatal("CCACHE_SERVER is not set");
+			}
+			/* Requests are run by main() in forked workers. */
+			exit(server_main(getenv("CCACHE_SERVER"), main));
+
+		case 'B':
+			/* Done below since --jobs may come later. */
+			batch_file = optarg;
+			break;
+
+		case 'p':
+			/* Done below since --jobs may come later. */
+			prefetch_file = optarg;
+			break;
+
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs <= 0) {
+				fatal("Invalid number of jobs: %s", optarg);
+			}
+			break;
+
 		case 'c':
+			/* Done below since --background may come later. */
 			check_cache_dir();
-			cleanup_all(cache_dir);
-			printf("Cleaned cache\n");
+			cleanup = 1;
+			break;
+
+		case 'b':
+			background = 1;
 			break;
 
 		case 'C':
@@ -2046,12 +3057,13 @@ static int ccache_main(int argc, char *argv[])
 
 		case 'F':
 			check_cache_dir();
-			v = atoi(optarg);
+			v = strtoull(optarg, NULL, 10);
 			if (stats_set_limits(v, -1) == 0) {
 				if (v == 0) {
 					printf("Unset cache file limit\n");
 				} else {
-					printf("Set cache file limit to %u\n", (unsigned)v);
+					printf("Set cache file limit to %llu\n",
+					       (unsigned long long)v);
 				}
 			} else {
 				printf("Could not set cache file limit.\n");
@@ -2083,6 +3095,33 @@ static int ccache_main(int argc, char *argv[])
 		}
 	}
 
+	if (cleanup) {
+		if (background) {
+			cleanup_all_in_background(cache_dir);
+			printf("Started cleanup in the background\n");
+		} else {
+			cleanup_all(cache_dir);
+			printf("Cleaned cache\n");
+		}
+	}
+
+	if (jobs == 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (prefetch_file) {
+		exit(batch_main(prefetch_file, jobs, prefetch_main));
+	}
+	if (batch_file) {
+		/* The compilations are run by main() in forked workers. */
+		exit(batch_main(batch_file, jobs, main));
+	}
+
+	if (print_stats && !stats_print(format)) {
+		fprintf(stderr, "ccache: unknown statistics format: %s\n",
+			format);
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -2114,6 +3153,7 @@ int main(int argc, char *argv[])
 {
 	char *p;
 	char *program_name;
+	int status;
 
 	/* the user might have set CCACHE_UMASK */
 	p = getenv("CCACHE_UMASK");
@@ -2150,6 +3190,11 @@ int main(int argc, char *argv[])
 	}
 	free(program_name);
 
+	status = server_forward(argc, argv);
+	if (status != -1) {
+		return status;
+	}
+
 	check_cache_dir();
 
 	temp_dir = getenv("CCACHE_TEMPDIR");
@@ -2184,6 +3229,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (!getenv("CCACHE_READONLY")) {
+		create_cache_header();
 		if (create_cachedirtag(cache_dir) != 0) {
 			fprintf(stderr,"ccache: failed to create %s/CACHEDIR.TAG (%s)\n",
 				cache_dir, strerror(errno));
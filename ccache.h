@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -55,10 +56,39 @@ enum stats {
 	STATS_END
 };
 
+/* phases of a compilation whose latencies are recorded in the stats files */
+enum stats_phase {
+	PHASE_COMMON_HASH,
+	PHASE_DIRECT_LOOKUP,
+	PHASE_PREPROCESSOR,
+	PHASE_CPP_HASH,
+	PHASE_COMPILER,
+	PHASE_STORE,
+	PHASE_COPY_OUT,
+	PHASE_MANIFEST_UPDATE,
+	PHASE_CLEANUP,
+
+	PHASE_END
+};
+
+/* number of power-of-two buckets of a latency histogram */
+#define LATENCY_BUCKETS 32
+
 #define SLOPPY_INCLUDE_FILE_MTIME 1
 #define SLOPPY_FILE_MACRO 2
 #define SLOPPY_TIME_MACROS 4
 
+/* An entry found by traverse(). */
+struct traverse_entry {
+	const char *path;  /* Full path. */
+	const char *name;  /* Last path component (points into path). */
+	int dirfd;         /* Descriptor of the containing directory, or -1. */
+	struct stat *st;
+};
+
+/* Make traverse() fill in all of struct stat for non-directories. */
+#define TRAVERSE_STAT 1
+
 void hash_start(struct mdfour *md);
 void hash_delimiter(struct mdfour *md, const char* type);
 void hash_string(struct mdfour *md, const char *s);
@@ -76,6 +106,7 @@ void fatal(const char *format, ...) ATTR_FORMAT(printf, 1, 2);
 void copy_fd(int fd_in, int fd_out);
 int copy_file(const char *src, const char *dest, int compress_dest);
 int move_file(const char *src, const char *dest, int compress_dest);
+int write_file(const char *path, const void *data, size_t len, int compress);
 int move_uncompressed_file(const char *src, const char *dest,
 			   int compress_dest);
 int test_if_compressed(const char *filename);
@@ -91,14 +122,19 @@ char *x_strdup(const char *s);
 char *x_strndup(const char *s, size_t n);
 void *x_realloc(void *ptr, size_t size);
 void *x_malloc(size_t size);
-void traverse(const char *dir, void (*fn)(const char *, struct stat *));
+void traverse(const char *dir, int flags,
+	      void (*fn)(struct traverse_entry *, void *), void *context);
+int traverse_unlink(struct traverse_entry *entry);
 char *basename(const char *s);
 char *dirname(char *s);
 const char *get_extension(const char *path);
 char *remove_extension(const char *path);
+int is_precompiled_header(const char *path);
+char *read_whole_file(const char *path, size_t *size);
 int read_lock_fd(int fd);
 int write_lock_fd(int fd);
-size_t file_size(struct stat *st);
+int try_write_lock_fd(int fd);
+uint64_t file_size(struct stat *st);
 int safe_open(const char *fname);
 char *x_realpath(const char *path);
 char *gnu_getcwd(void);
@@ -112,12 +148,22 @@ void update_mtime(const char *path);
 void stats_update(enum stats stat);
 void stats_zero(void);
 void stats_summary(void);
-void stats_update_size(enum stats stat, size_t size, unsigned files);
-void stats_read(const char *stats_file, unsigned counters[STATS_END]);
-int stats_set_limits(long maxfiles, long maxsize);
-size_t value_units(const char *s);
-char *format_size(size_t v);
-void stats_set_sizes(const char *dir, size_t num_files, size_t total_size);
+void stats_update_size(enum stats stat, int64_t size, unsigned files);
+void stats_flush(void);
+uint64_t stats_timer(void);
+void stats_latency(enum stats_phase phase, uint64_t start);
+void stats_add_latency(const char *dir, enum stats_phase phase, uint64_t usec);
+void stats_latency_summary(void);
+int stats_print(const char *format);
+void stats_read(const char *stats_file, uint64_t counters[STATS_END]);
+int stats_set_limits(int64_t maxfiles, int64_t maxsize);
+uint64_t value_units(const char *s);
+char *format_size(uint64_t v);
+void stats_set_sizes(const char *dir, uint64_t num_files, uint64_t total_size);
+int cache_shards(void);
+void create_cache_header(void);
+int shard_width(void);
+char *shard_dir(const char *dir, int shard);
 
 int unify_hash(struct mdfour *hash, const char *fname);
 
@@ -132,13 +178,49 @@ int asprintf(char **ptr, const char *, ...) ATTR_FORMAT(printf, 2, 3);
 int snprintf(char *, size_t, const char *, ...) ATTR_FORMAT(printf, 3, 4);
 #endif
 
-void cleanup_dir(const char *dir, size_t maxfiles, size_t maxsize);
+void cleanup_dir(const char *dir, uint64_t maxfiles, uint64_t maxsize);
+void record_compile_cost(const char *dir, const char *path,
+			 unsigned long compile_ms, uint64_t size);
+void record_access(const char *path);
 void cleanup_all(const char *dir);
+void cleanup_dir_in_background(const char *dir);
+void cleanup_all_in_background(const char *dir);
 void wipe_all(const char *dir);
 
+/* Output of a process, kept in memory unless it grows large. */
+struct output {
+	char *data;
+	size_t size;
+	size_t allocated;
+	char *spill_path;
+	int fd; /* Of spill_path once the output has moved there, else -1. */
+};
+
+void output_init(struct output *out, const char *spill_path);
+void output_free(struct output *out);
+void output_append(struct output *out, const void *data, size_t len);
+void output_append_output(struct output *dest, struct output *src);
+void output_copy_to_fd(struct output *out, int fd);
+int output_hash(struct mdfour *md, struct output *out);
+int output_save(struct output *out, const char *path, int compress);
+/* A process started by execute_start(). */
+struct process {
+	pid_t pid;
+	int fd_out; /* Read end of the stdout pipe, or -1 if to a file. */
+	int fd_err;
+	int own_group;
+};
+
 int execute(char **argv,
 	    const char *path_stdout,
-	    const char *path_stderr);
+	    struct output *out,
+	    struct output *err);
+int execute_start(char **argv,
+		  const char *path_stdout,
+		  int own_group,
+		  struct process *proc);
+int execute_finish(struct process *proc, struct output *out, struct output *err);
+void execute_kill(struct process *proc);
 char *find_executable(const char *name, const char *exclude_name);
 void print_command(FILE *fp, char **argv);
 void print_executed_command(FILE *fp, char **argv);
@@ -157,6 +239,8 @@ void args_add_prefix(ARGS *args, const char *s);
 void args_pop(ARGS *args, int n);
 void args_strip(ARGS *args, const char *prefix);
 void args_remove_first(ARGS *args);
+ARGS *args_init_from_gcc_atfile(const char *filename);
+void args_insert(ARGS *dest, int index, ARGS *src, int replace);
 
 #if HAVE_COMPAR_FN_T
 #define COMPAR_FN_T __compar_fn_t
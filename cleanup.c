@@ -18,33 +18,126 @@
  */
 
 #include "ccache.h"
+#include "hashtable.h"
+#include "hashtable_itr.h"
+#include "hashutil.h"
 
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef MAJOR_IN_SYSMACROS
+#include <sys/sysmacros.h>
+#endif
+#ifdef MAJOR_IN_MKDEV
+#include <sys/mkdev.h>
+#endif
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <utime.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+#define USE_THREADS 1
+#endif
+
+extern char *cache_dir;
 
 /*
- * When "max files" or "max cache size" is reached, one of the 16 cache
- * subdirectories is cleaned up. When doing so, files are deleted (in LRU
- * order) until the levels are below LIMIT_MULTIPLE.
+ * When "max files" or "max cache size" is reached, one of the top-level cache
+ * subdirectories (shards) is cleaned up. When doing so, files are deleted (in
+ * LRU order) until the levels are below LIMIT_MULTIPLE.
  */
 #define LIMIT_MULTIPLE 0.8
 
-static struct files {
+/*
+ * Name of the file in each cache subdirectory that a cleaner locks so that
+ * only one cleanup of the subdirectory runs at a time.
+ */
+#define CLEANUP_LOCK_NAME "cleanup.lock"
+
+/*
+ * Number of randomly picked files of which the oldest is evicted when
+ * cleaning up by sampling.
+ */
+#define EVICTION_SAMPLE_SIZE 8
+
+/*
+ * Number of entries of a directory of cached files that are looked at when
+ * picking a random file, so that picking doesn't slow down as it grows.
+ */
+#define EVICTION_SCAN_LIMIT 256
+
+/*
+ * Name of the file in each cache subdirectory where compile times of cached
+ * results are logged for cost-aware eviction.
+ */
+#define COSTS_NAME "costs"
+
+/*
+ * Name of the file in each cache subdirectory where cache hits are logged, so
+ * that hits don't have to update the mtime of the cached files. The hits are
+ * applied to the mtimes in batches when the log is compacted.
+ */
+#define ACCESS_LOG_NAME "access"
+
+/*
+ * Extension of the files that remember that the last lookup of a compilation
+ * was a miss (see CCACHE_SPECULATE), and how long such a file is kept.
+ */
+#define MISS_MARKER_EXT ".miss"
+#define MISS_MARKER_MAX_AGE (30 * 24 * 3600)
+
+/*
+ * Size above which a log in a cache subdirectory is compacted in the
+ * background, so that logs stay small also when no cleanup is needed.
+ */
+#define LOG_COMPACT_SIZE (256 * 1024)
+
+enum eviction_mode {
+	EVICTION_LRU,
+	EVICTION_SAMPLED,
+	EVICTION_COST
+};
+
+/* Compile time and size of a cached result, as recorded in the costs file. */
+struct cost {
+	unsigned long compile_ms;
+	uint64_t size; /* In bytes. */
+};
+
+struct files {
 	char *fname;
 	time_t mtime;
-	size_t size; /* In KiB. */
-} **files;
-static unsigned allocated; /* Size of the files array. */
-static unsigned num_files; /* Number of used entries in the files array. */
+	uint64_t size; /* In bytes. */
+	double score; /* Benefit of keeping the file; only for EVICTION_COST. */
+};
+
+/*
+ * State of the cleanup of one cache subdirectory. Several subdirectories may
+ * be cleaned up concurrently, so nothing here may be global.
+ */
+struct cleanup_state {
+	struct files **files;
+	unsigned allocated; /* Size of the files array. */
+	unsigned num_files; /* Number of used entries in the files array. */
+
+	enum eviction_mode mode;
+	struct hashtable *costs; /* Result name -> struct cost. */
 
-static size_t cache_size; /* In KiB. */
-static size_t files_in_cache;
-static size_t cache_size_threshold;
-static size_t files_in_cache_threshold;
+	uint64_t cache_size; /* In bytes. */
+	uint64_t files_in_cache;
+	uint64_t cache_size_threshold;
+	uint64_t files_in_cache_threshold;
+};
 
 /* File comparison function that orders files in mtime order, oldest first. */
 static int files_compare(struct files **f1, struct files **f2)
@@ -58,197 +151,1328 @@ static int files_compare(struct files **f1, struct files **f2)
 	return 1;
 }
 
-/* this builds the list of files in the cache */
-static void traverse_fn(const char *fname, struct stat *st)
+/*
+ * File comparison function that orders files by score, lowest first, and then
+ * in mtime order.
+ */
+static int files_compare_score(struct files **f1, struct files **f2)
+{
+	if ((*f1)->score < (*f2)->score) {
+		return -1;
+	}
+	if ((*f1)->score > (*f2)->score) {
+		return 1;
+	}
+	return files_compare(f1, f2);
+}
+
+/* Find out how cache subdirectories should be cleaned up. */
+static enum eviction_mode eviction_mode(void)
+{
+	char *mode = getenv("CCACHE_EVICTION");
+
+	if (!mode || strcmp(mode, "lru") == 0) {
+		return EVICTION_LRU;
+	}
+	if (strcmp(mode, "sampled") == 0) {
+		return EVICTION_SAMPLED;
+	}
+	if (strcmp(mode, "cost") == 0) {
+		return EVICTION_COST;
+	}
+	cc_log("Unknown eviction mode: %s", mode);
+	return EVICTION_LRU;
+}
+
+/* Check whether a file name is that of a miss marker. */
+static int is_miss_marker(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > strlen(MISS_MARKER_EXT)
+	       && strcmp(name + len - strlen(MISS_MARKER_EXT),
+			 MISS_MARKER_EXT) == 0;
+}
+
+/*
+ * Check whether a file in a cache subdirectory holds bookkeeping data instead
+ * of cached compiler output. Hash-named files never start with these names.
+ */
+static int is_metadata_file(const char *name)
+{
+	return strcmp(name, "stats") == 0
+	       || strcmp(name, CLEANUP_LOCK_NAME) == 0
+	       || strncmp(name, COSTS_NAME, strlen(COSTS_NAME)) == 0
+	       || strncmp(name, ACCESS_LOG_NAME, strlen(ACCESS_LOG_NAME)) == 0
+	       || is_miss_marker(name);
+}
+
+/* Lower the CPU and I/O priority of the current process as far as possible. */
+static void lower_priority(void)
 {
+	setpriority(PRIO_PROCESS, 0, 19);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	/* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT */
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+}
+
+/*
+ * Start a detached cleaner process so that the caller doesn't have to wait
+ * for the cleanup. Returns 1 in the cleaner and 0 in the calling process.
+ */
+static int spawn_cleaner(void)
+{
+	pid_t pid;
+	int fd;
 	char *p;
 
-	if (!S_ISREG(st->st_mode)) return;
+	pid = fork();
+	if (pid == -1) {
+		cc_log("Failed to fork cleaner (%s)", strerror(errno));
+		return 0;
+	}
+	if (pid != 0) {
+		/* The cleaner itself is reparented to init when its parent exits. */
+		waitpid(pid, NULL, 0);
+		return 0;
+	}
+
+	setsid();
+	pid = fork();
+	if (pid == -1) {
+		cc_log("Failed to fork cleaner (%s)", strerror(errno));
+	}
+	if (pid != 0) {
+		_exit(0);
+	}
+
+	/*
+	 * Don't keep the compiler output channels open; build tools may wait
+	 * for them to be closed.
+	 */
+	fd = open("/dev/null", O_RDWR);
+	if (fd != -1) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		if (fd > 2) {
+			close(fd);
+		}
+	}
+	p = getenv("UNCACHED_ERR_FD");
+	if (p) {
+		close(atoi(p));
+	}
+
+	lower_priority();
+	return 1;
+}
 
-	p = basename(fname);
-	if (strcmp(p, "stats") == 0) {
-		free(p);
+/*
+ * Take the cleanup lock of a cache subdirectory. If wait is false, give up
+ * instead of waiting when another cleaner holds the lock. Returns the locked
+ * file descriptor or -1 on failure.
+ */
+static int lock_cleanup(const char *dir, int wait)
+{
+	char *path;
+	int fd;
+
+	if (create_dir(dir) != 0) {
+		return -1;
+	}
+	x_asprintf(&path, "%s/%s", dir, CLEANUP_LOCK_NAME);
+	fd = safe_open(path);
+	free(path);
+	if (fd == -1) {
+		return -1;
+	}
+	if ((wait ? write_lock_fd(fd) : try_write_lock_fd(fd)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Compact a log of a cache subdirectory that has grown past LOG_COMPACT_SIZE
+ * by calling compact in a detached low-priority process. Nothing is done if a
+ * cleaner holds the lock; the log is then compacted on a later append.
+ */
+static void compact_log_in_background(const char *dir,
+				      void (*compact)(const char *dir))
+{
+	int fd;
+
+	if (!spawn_cleaner()) {
 		return;
 	}
+	fd = lock_cleanup(dir, 0);
+	if (fd != -1) {
+		cc_log("Compacting logs of %s in the background", dir);
+		compact(dir);
+		close(fd);
+	}
+	_exit(0);
+}
+
+/*
+ * Return the name that a file in a cache subdirectory has in the logs, i.e.
+ * its path relative to the subdirectory without extension. Caller frees.
+ */
+static char *log_name(const char *dir, const char *path)
+{
+	size_t len = strlen(dir);
+
+	if (strncmp(path, dir, len) == 0 && path[len] == '/') {
+		path += len + 1;
+	}
+	return remove_extension(path);
+}
+
+/*
+ * Append text consisting of whole lines to a log file in a cache
+ * subdirectory. A single write to a file opened for appending doesn't
+ * interleave with those of other processes. Returns the size of the log
+ * after the write or -1 on failure.
+ */
+static off_t append_to_log(const char *dir, const char *name, const char *text,
+			   size_t len)
+{
+	struct stat st;
+	char *path;
+	off_t size = -1;
+	int fd;
+
+	x_asprintf(&path, "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+	if (fd == -1 || write(fd, text, len) != (ssize_t)len) {
+		cc_log("Failed to append to %s (%s)", path, strerror(errno));
+	} else if (fstat(fd, &st) == 0) {
+		size = st.st_size;
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	free(path);
+	return size;
+}
+
+/* Buffer for appending many lines to a log with few writes. */
+struct log_buffer {
+	const char *dir;
+	const char *name;
+	char *data;
+	size_t len;
+	int failed; /* Whether a write has failed. */
+};
+
+#define LOG_BUFFER_SIZE 65536
 
-	if (strstr(p, ".tmp.") != NULL) {
+static void log_buffer_flush(struct log_buffer *buf)
+{
+	if (buf->len > 0) {
+		if (append_to_log(buf->dir, buf->name, buf->data,
+				  buf->len) == -1) {
+			buf->failed = 1;
+		}
+		buf->len = 0;
+	}
+}
+
+static void log_buffer_add(struct log_buffer *buf, const char *line)
+{
+	size_t len = strlen(line);
+
+	if (!buf->data) {
+		buf->data = x_malloc(LOG_BUFFER_SIZE);
+	}
+	if (buf->len + len > LOG_BUFFER_SIZE) {
+		log_buffer_flush(buf);
+	}
+	if (len > LOG_BUFFER_SIZE) {
+		return;
+	}
+	memcpy(buf->data + buf->len, line, len);
+	buf->len += len;
+}
+
+/*
+ * Move a log file of a cache subdirectory aside so that it can be read and
+ * compacted while new lines go to a fresh file. The caller must hold the
+ * cleanup lock and removes the taken log once its contents have been written
+ * back. A log left behind by an interrupted compaction is taken again
+ * instead. Returns the path of the taken log (to be freed by the caller) or
+ * NULL if there is no log.
+ */
+static char *take_log(const char *dir, const char *name)
+{
+	struct stat st;
+	char *path, *taken;
+
+	x_asprintf(&path, "%s/%s", dir, name);
+	x_asprintf(&taken, "%s.old", path);
+	if (lstat(taken, &st) != 0 && rename(path, taken) != 0) {
+		if (errno != ENOENT) {
+			cc_log("Failed to rename %s (%s)", path, strerror(errno));
+		}
+		free(taken);
+		taken = NULL;
+	}
+	free(path);
+	return taken;
+}
+
+/* Check whether the result or manifest with a given log name still exists. */
+static int log_name_exists(const char *dir, const char *name)
+{
+	struct stat st;
+	char *path;
+	int exists;
+
+	x_asprintf(&path, "%s/%s.o", dir, name);
+	exists = lstat(path, &st) == 0;
+	free(path);
+	if (!exists) {
+		x_asprintf(&path, "%s/%s.manifest", dir, name);
+		exists = lstat(path, &st) == 0;
+		free(path);
+	}
+	return exists;
+}
+
+/*
+ * Take the costs file of a cache subdirectory and read it. Later lines win.
+ * The path of the taken file is stored in *taken (NULL if there was none).
+ */
+static struct hashtable *read_costs(const char *dir, char **taken)
+{
+	struct hashtable *costs;
+	struct cost *cost;
+	char name[256];
+	unsigned long compile_ms;
+	unsigned long long size;
+	FILE *f;
+
+	costs = create_hashtable(1000, hash_from_string, strings_equal);
+	*taken = take_log(dir, COSTS_NAME);
+	if (!*taken) {
+		return costs;
+	}
+	f = fopen(*taken, "r");
+	if (!f) {
+		return costs;
+	}
+	while (fscanf(f, "%255s %lu %llu", name, &compile_ms, &size) == 3) {
+		cost = hashtable_search(costs, name);
+		if (!cost) {
+			cost = x_malloc(sizeof(*cost));
+			hashtable_insert(costs, x_strdup(name), cost);
+		}
+		cost->compile_ms = compile_ms;
+		cost->size = size;
+	}
+	fclose(f);
+	return costs;
+}
+
+/*
+ * Put back the costs read by read_costs(), leaving out results that no
+ * longer exist, and remove the taken file if that worked.
+ */
+static void write_back_costs(const char *dir, struct hashtable *costs,
+			     char *taken)
+{
+	struct hashtable_itr *iter;
+	struct cost *cost;
+	struct log_buffer buf;
+	char *line;
+	char *name;
+
+	if (!taken) {
+		return;
+	}
+	if (hashtable_count(costs) == 0) {
+		unlink(taken);
+		free(taken);
+		return;
+	}
+	memset(&buf, 0, sizeof(buf));
+	buf.dir = dir;
+	buf.name = COSTS_NAME;
+	iter = hashtable_iterator(costs);
+	do {
+		name = hashtable_iterator_key(iter);
+		cost = hashtable_iterator_value(iter);
+		if (log_name_exists(dir, name)) {
+			x_asprintf(&line, "%s %lu %llu\n", name,
+				   cost->compile_ms,
+				   (unsigned long long)cost->size);
+			log_buffer_add(&buf, line);
+			free(line);
+		}
+	} while (hashtable_iterator_advance(iter));
+	free(iter);
+	log_buffer_flush(&buf);
+	free(buf.data);
+	if (!buf.failed) {
+		unlink(taken);
+	}
+	free(taken);
+}
+
+/* Compact the costs file of a cache subdirectory. Needs the cleanup lock. */
+static void compact_costs(const char *dir)
+{
+	struct hashtable *costs;
+	char *taken;
+
+	costs = read_costs(dir, &taken);
+	write_back_costs(dir, costs, taken);
+	hashtable_destroy(costs, 1);
+}
+
+/*
+ * Record how long the compiler took to produce a cached result and how large
+ * the result is. dir is the cache subdirectory and path the result's object
+ * file. Nothing is recorded unless cost-aware eviction is used.
+ */
+void record_compile_cost(const char *dir, const char *path,
+			 unsigned long compile_ms, uint64_t size)
+{
+	char *name, *line;
+
+	if (eviction_mode() != EVICTION_COST) {
+		return;
+	}
+
+	name = log_name(dir, path);
+	x_asprintf(&line, "%s %lu %llu\n", name, compile_ms,
+		   (unsigned long long)size);
+	if (append_to_log(dir, COSTS_NAME, line, strlen(line))
+	    > LOG_COMPACT_SIZE) {
+		compact_log_in_background(dir, compact_costs);
+	}
+	free(line);
+	free(name);
+}
+
+/*
+ * Set the modification time of a file to that of a logged hit. Only the owner
+ * of a file may set a given time, so in a cache shared by several users the
+ * current time is used for the files of others.
+ */
+static void set_mtime(const char *path, time_t t)
+{
+#ifdef HAVE_UTIMES
+	struct timeval tv[2];
+
+	tv[0].tv_sec = t;
+	tv[0].tv_usec = 0;
+	tv[1] = tv[0];
+	if (utimes(path, tv) != 0 && errno == EPERM) {
+		update_mtime(path);
+	}
+#else
+	struct utimbuf buf;
+
+	buf.actime = t;
+	buf.modtime = t;
+	if (utime(path, &buf) != 0 && errno == EPERM) {
+		update_mtime(path);
+	}
+#endif
+}
+
+/*
+ * Apply the hits logged in the access log of a cache subdirectory to the
+ * modification times of the hit results and manifests, which cleanups go by,
+ * and empty the log. Each file is touched at most once however often it was
+ * hit. Needs the cleanup lock.
+ */
+static void fold_access_log(const char *dir)
+{
+	static const char *const extensions[] = {
+		".o", ".stderr", ".d", ".manifest", NULL
+	};
+	struct hashtable *accesses;
+	struct hashtable_itr *iter;
+	struct stat st;
+	char *taken, *path, *name;
+	char buf[256];
+	unsigned long when;
+	time_t *t;
+	FILE *f;
+	int i;
+
+	taken = take_log(dir, ACCESS_LOG_NAME);
+	if (!taken) {
+		return;
+	}
+	f = fopen(taken, "r");
+	if (!f) {
+		cc_log("Failed to open %s (%s)", taken, strerror(errno));
+		free(taken);
+		return;
+	}
+	accesses = create_hashtable(1000, hash_from_string, strings_equal);
+	while (fscanf(f, "%255s %lu", buf, &when) == 2) {
+		t = hashtable_search(accesses, buf);
+		if (!t) {
+			t = x_malloc(sizeof(*t));
+			*t = 0;
+			hashtable_insert(accesses, x_strdup(buf), t);
+		}
+		if ((time_t)when > *t) {
+			*t = when;
+		}
+	}
+	fclose(f);
+
+	if (hashtable_count(accesses) > 0) {
+		iter = hashtable_iterator(accesses);
+		do {
+			name = hashtable_iterator_key(iter);
+			t = hashtable_iterator_value(iter);
+			for (i = 0; extensions[i]; i++) {
+				x_asprintf(&path, "%s/%s%s", dir, name,
+					   extensions[i]);
+				if (lstat(path, &st) == 0 && st.st_mtime < *t) {
+					set_mtime(path, *t);
+				}
+				free(path);
+			}
+		} while (hashtable_iterator_advance(iter));
+		free(iter);
+	}
+	hashtable_destroy(accesses, 1);
+
+	/* Only now are the hits safe from an interrupted compaction. */
+	unlink(taken);
+	free(taken);
+}
+
+/*
+ * Hits of this invocation that haven't been written to the access logs yet,
+ * per cache subdirectory. They are written by flush_accesses(), at exit at
+ * the latest, so that an invocation appends to each log once.
+ */
+struct pending_access {
+	char *dir;
+	char *lines;
+};
+static struct pending_access *pending_accesses;
+static int num_pending_accesses;
+
+/*
+ * Write the pending hits to the access logs. Logs that have grown past
+ * LOG_COMPACT_SIZE are compacted in the background.
+ */
+static void flush_accesses(void)
+{
+	struct pending_access *pending;
+	int i;
+
+	for (i = 0; i < num_pending_accesses; i++) {
+		pending = &pending_accesses[i];
+		if (append_to_log(pending->dir, ACCESS_LOG_NAME,
+				  pending->lines, strlen(pending->lines))
+		    > LOG_COMPACT_SIZE) {
+			compact_log_in_background(pending->dir,
+						  fold_access_log);
+		}
+		free(pending->dir);
+		free(pending->lines);
+	}
+	free(pending_accesses);
+	pending_accesses = NULL;
+	num_pending_accesses = 0;
+}
+
+/*
+ * Record a cache hit of a file in the cache instead of updating its mtime,
+ * which would be an inode write per file and hit.
+ */
+void record_access(const char *path)
+{
+	static int registered = 0;
+	size_t len = strlen(cache_dir);
+	struct pending_access *pending = NULL;
+	char *dir, *name, *lines;
+	int i;
+
+	if (strncmp(path, cache_dir, len) != 0 || path[len] != '/') {
+		return;
+	}
+	if (!registered) {
+		atexit(flush_accesses);
+		registered = 1;
+	}
+
+	/* The cache subdirectory is the first level below the cache dir. */
+	dir = x_strndup(path, len + 1 + shard_width());
+	for (i = 0; i < num_pending_accesses; i++) {
+		if (strcmp(pending_accesses[i].dir, dir) == 0) {
+			pending = &pending_accesses[i];
+			break;
+		}
+	}
+	if (!pending) {
+		pending_accesses = x_realloc(
+			pending_accesses,
+			(num_pending_accesses + 1) * sizeof(*pending_accesses));
+		pending = &pending_accesses[num_pending_accesses++];
+		pending->dir = dir;
+		pending->lines = x_strdup("");
+	} else {
+		free(dir);
+	}
+
+	name = log_name(pending->dir, path);
+	x_asprintf(&lines, "%s%s %lu\n", pending->lines, name,
+		   (unsigned long)time(NULL));
+	free(pending->lines);
+	pending->lines = lines;
+	free(name);
+
+	/* Long-running invocations shouldn't hold on to many hits. */
+	if (strlen(lines) > LOG_BUFFER_SIZE) {
+		flush_accesses();
+	}
+}
+
+/*
+ * Score the files of a cache subdirectory by the compile time saved per KiB
+ * and second since last use. Files without a recorded compile time (such as
+ * manifests) are assumed to cost the average compile time per KiB.
+ */
+static void score_files(const char *dir, struct cleanup_state *state)
+{
+	struct cost *cost;
+	double total_ms = 0, total_kib = 0, ms_per_kib = 0, ms, kib, age;
+	time_t now = time(NULL);
+	unsigned i;
+	char *name;
+	struct cost **found;
+
+	found = x_malloc((state->num_files + 1) * sizeof(*found));
+	for (i = 0; i < state->num_files; i++) {
+		name = log_name(dir, state->files[i]->fname);
+		found[i] = hashtable_search(state->costs, name);
+		free(name);
+		if (found[i]) {
+			total_ms += found[i]->compile_ms;
+			total_kib += found[i]->size / 1024.0;
+		}
+	}
+	if (total_kib > 0) {
+		ms_per_kib = total_ms / total_kib;
+	}
+
+	for (i = 0; i < state->num_files; i++) {
+		cost = found[i];
+		if (cost) {
+			ms = cost->compile_ms;
+			kib = cost->size / 1024.0;
+		} else {
+			kib = state->files[i]->size / 1024.0;
+			ms = ms_per_kib * kib;
+		}
+		if (kib < 1) {
+			kib = 1;
+		}
+		age = difftime(now, state->files[i]->mtime);
+		if (age < 1) {
+			age = 1;
+		}
+		state->files[i]->score = ms / (kib * age);
+	}
+	free(found);
+}
+
+/* this builds the list of files in the cache */
+static void traverse_fn(struct traverse_entry *entry, void *context)
+{
+	struct cleanup_state *state = context;
+	struct stat *st = entry->st;
+
+	if (!S_ISREG(st->st_mode)) return;
+
+	if (strstr(entry->name, ".tmp.") != NULL) {
 		/* delete any tmp files older than 1 hour */
 		if (st->st_mtime + 3600 < time(NULL)) {
-			unlink(fname);
-			free(p);
+			traverse_unlink(entry);
 			return;
 		}
 	}
 
-	free(p);
+	if (is_miss_marker(entry->name)) {
+		/* markers aren't counted, so drop the ones not used for long */
+		if (st->st_mtime + MISS_MARKER_MAX_AGE < time(NULL)) {
+			traverse_unlink(entry);
+		}
+		return;
+	}
 
-	if (num_files == allocated) {
-		allocated = 10000 + num_files*2;
-		files = (struct files **)x_realloc(
-			files, sizeof(struct files *)*allocated);
+	if (is_metadata_file(entry->name)) {
+		return;
 	}
 
-	files[num_files] = (struct files *)x_malloc(sizeof(struct files));
-	files[num_files]->fname = x_strdup(fname);
-	files[num_files]->mtime = st->st_mtime;
-	files[num_files]->size = file_size(st) / 1024;
-	cache_size += files[num_files]->size;
-	files_in_cache++;
-	num_files++;
+	if (state->num_files == state->allocated) {
+		state->allocated = 10000 + state->num_files*2;
+		state->files = (struct files **)x_realloc(
+			state->files, sizeof(struct files *)*state->allocated);
+	}
+
+	state->files[state->num_files] =
+		(struct files *)x_malloc(sizeof(struct files));
+	state->files[state->num_files]->fname = x_strdup(entry->path);
+	state->files[state->num_files]->mtime = st->st_mtime;
+	state->files[state->num_files]->size = file_size(st);
+	state->cache_size += state->files[state->num_files]->size;
+	state->files_in_cache++;
+	state->num_files++;
 }
 
-static void delete_file(const char *path, size_t size)
+static void delete_file(struct cleanup_state *state, const char *path,
+			uint64_t size)
 {
 	if (unlink(path) == 0) {
-		cache_size -= size;
-		files_in_cache--;
+		state->cache_size -= size;
+		state->files_in_cache--;
 	} else if (errno != ENOENT) {
 		cc_log("Failed to unlink %s (%s)", path, strerror(errno));
 	}
 }
 
-static void delete_sibling_file(const char *base, const char *extension)
+static void delete_sibling_file(struct cleanup_state *state, const char *base,
+				const char *extension)
 {
 	struct stat st;
 	char *path;
 
 	x_asprintf(&path, "%s%s", base, extension);
 	if (lstat(path, &st) == 0) {
-		delete_file(path, file_size(&st) / 1024);
+		delete_file(state, path, file_size(&st));
 	} else if (errno != ENOENT) {
 		cc_log("Failed to stat %s (%s)", path, strerror(errno));
 	}
 	free(path);
 }
 
+/* Check whether the cache subdirectory is still above the thresholds. */
+static int above_thresholds(struct cleanup_state *state)
+{
+	return (state->cache_size_threshold != 0
+	        && state->cache_size > state->cache_size_threshold)
+	       || (state->files_in_cache_threshold != 0
+	           && state->files_in_cache > state->files_in_cache_threshold);
+}
+
+/*
+ * Delete a file from the cache. If it's part of a cached result, the whole
+ * result is deleted.
+ */
+static void evict_file(struct cleanup_state *state, const char *fname,
+		       uint64_t size)
+{
+	const char *ext;
+	char *base;
+
+	ext = get_extension(fname);
+	if (strcmp(ext, ".o") == 0
+	    || strcmp(ext, ".d") == 0
+	    || strcmp(ext, ".stderr") == 0
+	    || strcmp(ext, "") == 0) {
+		/*
+		 * Make sure that all sibling files are deleted so that a cached result
+		 * is removed completely. Note the order of deletions -- the stderr
+		 * file must be deleted last because if the ccache process gets killed
+		 * after deleting the .stderr but before deleting the .o, the cached
+		 * result would be inconsistent.
+		 */
+		base = remove_extension(fname);
+		delete_sibling_file(state, base, ".o");
+		delete_sibling_file(state, base, ".d");
+		delete_sibling_file(state, base, ".stderr");
+		delete_sibling_file(state, base, ""); /* Object file from ccache 2.4. */
+		free(base);
+	} else {
+		/* .manifest or unknown file. */
+		delete_file(state, fname, size);
+	}
+}
+
 /* sort the files we've found and delete the oldest ones until we are
    below the thresholds */
-static void sort_and_clean(void)
+static void sort_and_clean(struct cleanup_state *state)
 {
 	unsigned i;
-	const char *ext;
+	char *base;
 	char *last_base = x_strdup("");
 
-	if (num_files > 1) {
-		/* Sort in ascending mtime order. */
-		qsort(files, num_files, sizeof(struct files *),
-		      (COMPAR_FN_T)files_compare);
+	if (state->num_files > 1) {
+		if (state->mode == EVICTION_COST) {
+			/* Sort in ascending score order. */
+			qsort(state->files, state->num_files,
+			      sizeof(struct files *),
+			      (COMPAR_FN_T)files_compare_score);
+		} else {
+			/* Sort in ascending mtime order. */
+			qsort(state->files, state->num_files,
+			      sizeof(struct files *),
+			      (COMPAR_FN_T)files_compare);
+		}
 	}
 
 	/* delete enough files to bring us below the threshold */
-	for (i = 0; i < num_files; i++) {
-		if ((cache_size_threshold == 0
-		     || cache_size <= cache_size_threshold)
-		    && (files_in_cache_threshold == 0
-		        || files_in_cache <= files_in_cache_threshold)) {
+	for (i = 0; i < state->num_files && above_thresholds(state); i++) {
+		base = remove_extension(state->files[i]->fname);
+		if (strcmp(base, last_base) != 0) { /* Avoid redundant unlinks. */
+			evict_file(state, state->files[i]->fname,
+				   state->files[i]->size);
+		}
+		free(last_base);
+		last_base = base;
+	}
+	free(last_base);
+}
+
+/*
+ * Count the levels of hash-named directories below a cache subdirectory by
+ * following the first one found on each level.
+ */
+static int count_hash_levels(const char *dir)
+{
+	static const char digits[] = "0123456789abcdef";
+	char *path = x_strdup(dir);
+	char *p = NULL;
+	struct stat st;
+	int levels, i;
+
+	for (levels = 0; levels < 8; levels++) {
+		for (i = 0; i < 16; i++) {
+			x_asprintf(&p, "%s/%c", path, digits[i]);
+			if (lstat(p, &st) == 0 && S_ISDIR(st.st_mode)) {
+				break;
+			}
+			free(p);
+		}
+		if (i == 16) {
 			break;
 		}
+		free(path);
+		path = p;
+	}
+	free(path);
+	return levels;
+}
+
+/*
+ * Pick a random file in a cache subdirectory. The given number of hash-named
+ * directory levels is descended by taking random hex digits as names, and
+ * only the first EVICTION_SCAN_LIMIT entries of the directory holding the
+ * files are considered. Returns the path of the file (to be freed by the
+ * caller) or NULL if no file was found.
+ */
+static char *pick_random_file(const char *dir, int levels, unsigned *seed,
+			      struct stat *st)
+{
+	static const char digits[] = "0123456789abcdef";
+	char *path = x_strdup(dir);
+	char *chosen = NULL;
+	char *p;
+	unsigned seen = 0;
+	int i;
+	DIR *d;
+	struct dirent *de;
 
-		ext = get_extension(files[i]->fname);
-		if (strcmp(ext, ".o") == 0
-		    || strcmp(ext, ".d") == 0
-		    || strcmp(ext, ".stderr") == 0
-		    || strcmp(ext, "") == 0) {
-			char *base = remove_extension(files[i]->fname);
-			if (strcmp(base, last_base) != 0) { /* Avoid redundant unlinks. */
-				/*
-				 * Make sure that all sibling files are deleted so that a cached result
-				 * is removed completely. Note the order of deletions -- the stderr
-				 * file must be deleted last because if the ccache process gets killed
-				 * after deleting the .stderr but before deleting the .o, the cached
-				 * result would be inconsistent.
-				 */
-				delete_sibling_file(base, ".o");
-				delete_sibling_file(base, ".d");
-				delete_sibling_file(base, ".stderr");
-				delete_sibling_file(base, ""); /* Object file from ccache 2.4. */
+	for (i = 0; i < levels; i++) {
+		x_asprintf(&p, "%s/%c", path, digits[rand_r(seed) % 16]);
+		free(path);
+		path = p;
+	}
+
+	d = opendir(path);
+	if (!d) {
+		free(path);
+		return NULL;
+	}
+	while (seen < EVICTION_SCAN_LIMIT && (de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0
+		    || strcmp(de->d_name, "..") == 0
+		    || is_metadata_file(de->d_name)) {
+			continue;
+		}
+		/* Reservoir sampling of one entry. */
+		seen++;
+		if (rand_r(seed) % seen == 0) {
+			free(chosen);
+			chosen = x_strdup(de->d_name);
+		}
+	}
+	closedir(d);
+
+	p = NULL;
+	if (chosen) {
+		x_asprintf(&p, "%s/%s", path, chosen);
+		free(chosen);
+		if (lstat(p, st) != 0 || !S_ISREG(st->st_mode)) {
+			free(p);
+			p = NULL;
+		}
+	}
+	free(path);
+	return p;
+}
+
+/*
+ * Bring a cache subdirectory below the thresholds by repeatedly picking
+ * EVICTION_SAMPLE_SIZE random files and evicting the oldest of them. The
+ * current size is taken from the statistics counters instead of a full scan,
+ * so the cost depends on the number of evicted files, not on the cache size.
+ * Returns 0 if sampling kept finding nothing, which means that the counters
+ * are too far off to be trusted.
+ */
+static int sample_and_clean(const char *dir, struct cleanup_state *state)
+{
+	unsigned seed;
+	unsigned misses = 0;
+	unsigned i;
+	int levels;
+	const char *p;
+	char *path, *oldest;
+	struct stat st, oldest_st;
+
+	seed = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+	for (p = dir; *p; p++) {
+		seed = seed * 31 + (unsigned char)*p;
+	}
+	levels = count_hash_levels(dir);
+
+	while (above_thresholds(state)) {
+		oldest = NULL;
+		for (i = 0; i < EVICTION_SAMPLE_SIZE; i++) {
+			path = pick_random_file(dir, levels, &seed, &st);
+			if (!path) {
+				continue;
+			}
+			if (strstr(path, ".tmp.") != NULL
+			    && st.st_mtime + 3600 < time(NULL)) {
+				/* delete any tmp files older than 1 hour */
+				unlink(path);
+				free(path);
+				continue;
+			}
+			if (!oldest || st.st_mtime < oldest_st.st_mtime) {
+				free(oldest);
+				oldest = path;
+				oldest_st = st;
+			} else {
+				free(path);
 			}
-			free(last_base);
-			last_base = base;
-		} else {
-			/* .manifest or unknown file. */
-			delete_file(files[i]->fname, files[i]->size);
 		}
+
+		if (!oldest) {
+			if (++misses == 10) {
+				return 0;
+			}
+			continue;
+		}
+		misses = 0;
+		evict_file(state, oldest, file_size(&oldest_st));
+		free(oldest);
 	}
-	free(last_base);
+	return 1;
+}
+
+/* Clean up a cache subdirectory by sampling, based on its counters. */
+static void cleanup_dir_sampled(const char *dir, uint64_t *counters)
+{
+	struct cleanup_state state;
+
+	cc_log("Cleaning up cache directory %s by sampling", dir);
+
+	memset(&state, 0, sizeof(state));
+	state.cache_size = counters[STATS_TOTALSIZE];
+	state.files_in_cache = counters[STATS_NUMFILES];
+	state.cache_size_threshold =
+		(uint64_t)(counters[STATS_MAXSIZE] * LIMIT_MULTIPLE);
+	state.files_in_cache_threshold =
+		(uint64_t)(counters[STATS_MAXFILES] * LIMIT_MULTIPLE);
+	fold_access_log(dir);
+
+	if (sample_and_clean(dir, &state)) {
+		stats_set_sizes(dir, state.files_in_cache, state.cache_size);
+		return;
+	}
+
+	cc_log("Found too few files in %s; doing a full cleanup", dir);
+	cleanup_dir(dir, counters[STATS_MAXFILES], counters[STATS_MAXSIZE]);
 }
 
 /* cleanup in one cache subdir */
-void cleanup_dir(const char *dir, size_t maxfiles, size_t maxsize)
+void cleanup_dir(const char *dir, uint64_t maxfiles, uint64_t maxsize)
 {
+	struct cleanup_state state;
+	char *costs_taken = NULL;
 	unsigned i;
 
 	cc_log("Cleaning up cache directory %s", dir);
 
-	cache_size_threshold = maxsize * LIMIT_MULTIPLE;
-	files_in_cache_threshold = maxfiles * LIMIT_MULTIPLE;
+	memset(&state, 0, sizeof(state));
+	state.mode = eviction_mode();
+	state.cache_size_threshold = (uint64_t)(maxsize * LIMIT_MULTIPLE);
+	state.files_in_cache_threshold = (uint64_t)(maxfiles * LIMIT_MULTIPLE);
 
-	num_files = 0;
-	cache_size = 0;
-	files_in_cache = 0;
+	/* Files are as recently used as their last logged hit. */
+	fold_access_log(dir);
 
 	/* build a list of files */
-	traverse(dir, traverse_fn);
+	traverse(dir, TRAVERSE_STAT, traverse_fn, &state);
+
+	if (state.mode == EVICTION_COST) {
+		state.costs = read_costs(dir, &costs_taken);
+		score_files(dir, &state);
+	}
 
 	/* clean the cache */
-	sort_and_clean();
+	sort_and_clean(&state);
+
+	stats_set_sizes(dir, state.files_in_cache, state.cache_size);
 
-	stats_set_sizes(dir, files_in_cache, cache_size);
+	if (state.costs) {
+		write_back_costs(dir, state.costs, costs_taken);
+		hashtable_destroy(state.costs, 1);
+	}
 
 	/* free it up */
-	for (i = 0; i < num_files; i++) {
-		free(files[i]->fname);
-		free(files[i]);
-		files[i] = NULL;
+	for (i = 0; i < state.num_files; i++) {
+		free(state.files[i]->fname);
+		free(state.files[i]);
+	}
+	if (state.files) {
+		free(state.files);
+	}
+}
+
+/*
+ * Read the limits of a cache subdirectory and clean it up. Automatic cleanups
+ * (only_if_needed) may evict by sampling; otherwise the whole subdirectory is
+ * scanned so that the counters are recalculated.
+ */
+static void cleanup_dir_with_limits(const char *dir, int only_if_needed)
+{
+	uint64_t counters[STATS_END];
+	char *sfile;
+	uint64_t start;
+
+	x_asprintf(&sfile, "%s/stats", dir);
+	memset(counters, 0, sizeof(counters));
+	stats_read(sfile, counters);
+	free(sfile);
+
+	if (only_if_needed
+	    && (counters[STATS_MAXFILES] == 0
+	        || counters[STATS_NUMFILES] <= counters[STATS_MAXFILES])
+	    && (counters[STATS_MAXSIZE] == 0
+	        || counters[STATS_TOTALSIZE] <= counters[STATS_MAXSIZE])) {
+		/* Another cleaner got here first. */
+		return;
+	}
+
+	start = stats_timer();
+	if (only_if_needed && eviction_mode() == EVICTION_SAMPLED) {
+		cleanup_dir_sampled(dir, counters);
+	} else {
+		cleanup_dir(dir, counters[STATS_MAXFILES],
+			    counters[STATS_MAXSIZE]);
+	}
+	stats_add_latency(dir, PHASE_CLEANUP, stats_timer() - start);
+}
+
+/*
+ * Decide how many cache subdirectories to process concurrently. Rotating disks
+ * only get slower from parallel I/O, so one thread is used for them.
+ */
+static int cleanup_jobs(const char *dir)
+{
+	char *p;
+	int jobs = 1;
+#ifdef __linux__
+	struct stat st;
+	char *path;
+	FILE *f;
+	int rotational = 0;
+#endif
+
+	p = getenv("CCACHE_CLEANUP_JOBS");
+	if (p) {
+		jobs = atoi(p);
+	} else {
+#ifdef _SC_NPROCESSORS_ONLN
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#ifdef __linux__
+		if (stat(dir, &st) == 0) {
+			/* Whole disk first, then the disk of a partition. */
+			x_asprintf(&path, "/sys/dev/block/%u:%u/queue/rotational",
+				   (unsigned)major(st.st_dev),
+				   (unsigned)minor(st.st_dev));
+			f = fopen(path, "r");
+			free(path);
+			if (!f) {
+				x_asprintf(&path,
+					   "/sys/dev/block/%u:%u/../queue/rotational",
+					   (unsigned)major(st.st_dev),
+					   (unsigned)minor(st.st_dev));
+				f = fopen(path, "r");
+				free(path);
+			}
+			if (f) {
+				rotational = fgetc(f) == '1';
+				fclose(f);
+			}
+		}
+		if (rotational) {
+			jobs = 1;
+		}
+#endif
+	}
+
+	if (jobs < 1) {
+		jobs = 1;
+	}
+	if (jobs > 16) {
+		jobs = 16;
+	}
+	return jobs;
+}
+
+struct dir_queue {
+	char **dirs;
+	int num_dirs;
+	int next;
+	void (*fn)(const char *dir);
+#ifdef USE_THREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+/* Worker that processes directories from the queue until it's empty. */
+static void *dir_queue_worker(void *arg)
+{
+	struct dir_queue *queue = arg;
+	int i;
+
+	while (1) {
+#ifdef USE_THREADS
+		pthread_mutex_lock(&queue->mutex);
+#endif
+		i = queue->next++;
+#ifdef USE_THREADS
+		pthread_mutex_unlock(&queue->mutex);
+#endif
+		if (i >= queue->num_dirs) {
+			break;
+		}
+		queue->fn(queue->dirs[i]);
+	}
+	return NULL;
+}
+
+/* Call fn() on each directory, using at most jobs threads. */
+static void for_each_dir(char **dirs, int num_dirs, int jobs,
+			 void (*fn)(const char *dir))
+{
+	struct dir_queue queue;
+#ifdef USE_THREADS
+	pthread_t threads[16];
+	int num_threads = 0;
+	int i;
+#endif
+
+	queue.dirs = dirs;
+	queue.num_dirs = num_dirs;
+	queue.next = 0;
+	queue.fn = fn;
+
+#ifdef USE_THREADS
+	pthread_mutex_init(&queue.mutex, NULL);
+	if (jobs > num_dirs) {
+		jobs = num_dirs;
+	}
+	/* Logging before the threads start also opens the log only once. */
+	cc_log("Processing %d directories with %d threads", num_dirs, jobs);
+	/* The calling thread is one of the workers. */
+	for (i = 1; i < jobs && i <= 16; i++) {
+		if (pthread_create(&threads[num_threads], NULL,
+				   dir_queue_worker, &queue) != 0) {
+			cc_log("Failed to create cleanup thread");
+			break;
+		}
+		num_threads++;
 	}
-	if (files) {
-		free(files);
+	dir_queue_worker(&queue);
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	allocated = 0;
-	files = NULL;
+	pthread_mutex_destroy(&queue.mutex);
+#else
+	(void)jobs;
+	dir_queue_worker(&queue);
+#endif
+}
+
+/* Clean up one cache subdirectory, waiting for any other cleaner first. */
+static void cleanup_locked_dir(const char *dir)
+{
+	int fd;
 
-	num_files = 0;
-	cache_size = 0;
-	files_in_cache = 0;
+	fd = lock_cleanup(dir, 1);
+	cleanup_dir_with_limits(dir, 0);
+	if (fd != -1) {
+		close(fd);
+	}
 }
 
 /* cleanup in all cache subdirs */
 void cleanup_all(const char *dir)
 {
-	unsigned counters[STATS_END];
-	char *dname, *sfile;
+	int shards;
+	char **dnames;
 	int i;
 
-	for (i = 0; i <= 0xF; i++) {
-		x_asprintf(&dname, "%s/%1x", dir, i);
-		x_asprintf(&sfile, "%s/%1x/stats", dir, i);
+	create_cache_header();
+	shards = cache_shards();
 
-		memset(counters, 0, sizeof(counters));
-		stats_read(sfile, counters);
+	dnames = x_malloc(shards * sizeof(*dnames));
+	for (i = 0; i < shards; i++) {
+		dnames[i] = shard_dir(dir, i);
+	}
 
-		cleanup_dir(dname,
-			    counters[STATS_MAXFILES],
-			    counters[STATS_MAXSIZE]);
-		free(dname);
-		free(sfile);
+	for_each_dir(dnames, shards, cleanup_jobs(dir), cleanup_locked_dir);
+
+	for (i = 0; i < shards; i++) {
+		free(dnames[i]);
 	}
+	free(dnames);
 }
 
-/* traverse function for wiping files */
-static void wipe_fn(const char *fname, struct stat *st)
+/*
+ * Clean up one cache subdirectory in a detached low-priority process. Nothing
+ * is done if another cleaner is already working on the subdirectory.
+ */
+void cleanup_dir_in_background(const char *dir)
 {
-	char *p;
+	int fd;
 
-	if (!S_ISREG(st->st_mode)) return;
+	if (!spawn_cleaner()) {
+		return;
+	}
+
+	fd = lock_cleanup(dir, 0);
+	if (fd == -1) {
+		cc_log("Cleanup of %s already in progress", dir);
+		_exit(0);
+	}
+	cc_log("Cleaning up %s in the background", dir);
+	cleanup_dir_with_limits(dir, 1);
+	close(fd);
+	_exit(0);
+}
 
-	p = basename(fname);
-	if (strcmp(p, "stats") == 0) {
-		free(p);
+/* Run cleanup_all() in a detached low-priority process. */
+void cleanup_all_in_background(const char *dir)
+{
+	if (!spawn_cleaner()) {
 		return;
 	}
-	free(p);
 
-	unlink(fname);
+	cleanup_all(dir);
+	_exit(0);
+}
+
+/* traverse function for removing a directory tree */
+static void remove_fn(struct traverse_entry *entry, void *context)
+{
+	(void)context;
+	traverse_unlink(entry);
+}
+
+static void remove_tree(const char *dir)
+{
+	cc_log("Removing %s", dir);
+	traverse(dir, 0, remove_fn, NULL);
+	if (rmdir(dir) != 0 && errno != ENOENT) {
+		cc_log("Failed to remove %s (%s)", dir, strerror(errno));
+	}
+}
+
+/*
+ * Move a cache subdirectory out of the way so that it can be deleted at
+ * leisure, keeping its statistics file (and thereby its limits) in place.
+ */
+static void rename_away(const char *dname)
+{
+	char *wiped, *old_stats, *new_stats;
+
+	x_asprintf(&wiped, "%s.wipe.%s", dname, tmp_string());
+	if (rename(dname, wiped) != 0) {
+		if (errno != ENOENT) {
+			cc_log("Failed to rename %s to %s (%s)",
+			       dname, wiped, strerror(errno));
+		}
+		free(wiped);
+		return;
+	}
+
+	create_dir(dname);
+	x_asprintf(&old_stats, "%s/stats", wiped);
+	x_asprintf(&new_stats, "%s/stats", dname);
+	rename(old_stats, new_stats);
+	free(new_stats);
+	free(old_stats);
+	free(wiped);
+}
+
+/*
+ * Delete the subdirectories that wipe_all() has moved out of the way,
+ * including leftovers of earlier interrupted wipes, in a detached
+ * low-priority process.
+ */
+static void remove_wiped_in_background(const char *dir)
+{
+	char **wiped = NULL;
+	int num_wiped = 0;
+	int i;
+	DIR *d;
+	struct dirent *de;
+
+	if (!spawn_cleaner()) {
+		return;
+	}
+
+	d = opendir(dir);
+	if (d) {
+		while ((de = readdir(d))) {
+			if (strstr(de->d_name, ".wipe.")) {
+				wiped = x_realloc(wiped,
+						  (num_wiped + 1) * sizeof(*wiped));
+				x_asprintf(&wiped[num_wiped], "%s/%s",
+					   dir, de->d_name);
+				num_wiped++;
+			}
+		}
+		closedir(d);
+	}
+	for_each_dir(wiped, num_wiped, cleanup_jobs(dir), remove_tree);
+	for (i = 0; i < num_wiped; i++) {
+		free(wiped[i]);
+	}
+	free(wiped);
+	_exit(0);
 }
 
 /* wipe all cached files in all subdirs */
@@ -257,12 +1481,17 @@ void wipe_all(const char *dir)
 	char *dname;
 	int i;
 
-	for (i = 0; i <= 0xF; i++) {
-		x_asprintf(&dname, "%s/%1x", dir, i);
-		traverse(dir, wipe_fn);
+	/* First make the cache look empty to everybody else... */
+	create_cache_header();
+	for (i = 0; i < cache_shards(); i++) {
+		dname = shard_dir(dir, i);
+		rename_away(dname);
 		free(dname);
 	}
 
-	/* and fix the counters */
+	/* ...fix the counters... */
 	cleanup_all(dir);
+
+	/* ...and delete the old contents without making the caller wait. */
+	remove_wiped_in_background(dir);
 }
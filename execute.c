@@ -21,52 +21,347 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+
+/* Output larger than this is moved from memory to the spill file. */
+#define OUTPUT_MEMORY_LIMIT (1024 * 1024)
 
 /*
-  execute a compiler backend, capturing all output to the given paths
-  the full path to the compiler to run is in argv[0]
-*/
-int execute(char **argv,
-	    const char *path_stdout,
-	    const char *path_stderr)
+ * Prepare to capture output. It is kept in memory, but moved to spill_path if
+ * it grows larger than OUTPUT_MEMORY_LIMIT.
+ */
+void output_init(struct output *out, const char *spill_path)
+{
+	out->data = NULL;
+	out->size = 0;
+	out->allocated = 0;
+	out->spill_path = x_strdup(spill_path);
+	out->fd = -1;
+}
+
+/* Free captured output and remove its spill file, if any. */
+void output_free(struct output *out)
+{
+	if (out->fd != -1) {
+		close(out->fd);
+		unlink(out->spill_path);
+		out->fd = -1;
+	}
+	free(out->data);
+	out->data = NULL;
+	out->size = 0;
+	out->allocated = 0;
+	free(out->spill_path);
+	out->spill_path = NULL;
+}
+
+/* Add data to captured output. */
+void output_append(struct output *out, const void *data, size_t len)
+{
+	if (out->fd == -1 && out->size + len > OUTPUT_MEMORY_LIMIT) {
+		unlink(out->spill_path);
+		out->fd = open(out->spill_path,
+			       O_RDWR|O_CREAT|O_TRUNC|O_EXCL|O_BINARY, 0666);
+		if (out->fd == -1
+		    || write(out->fd, out->data, out->size) != (ssize_t)out->size) {
+			fatal("Failed to write %s (%s)",
+			      out->spill_path, strerror(errno));
+		}
+		free(out->data);
+		out->data = NULL;
+		out->allocated = 0;
+	}
+	if (out->fd != -1) {
+		if (write(out->fd, data, len) != (ssize_t)len) {
+			fatal("Failed to write %s (%s)",
+			      out->spill_path, strerror(errno));
+		}
+	} else if (len > 0) {
+		if (out->size + len > out->allocated) {
+			out->allocated = 2 * (out->size + len);
+			out->data = x_realloc(out->data, out->allocated);
+		}
+		memcpy(out->data + out->size, data, len);
+	}
+	out->size += len;
+}
+
+/* Call fn with the captured output, in chunks if it has been spilled. */
+static int output_read(struct output *out,
+		       void (*fn)(void *context, const char *data, size_t len),
+		       void *context)
+{
+	char buf[10240];
+	ssize_t n;
+
+	if (out->fd == -1) {
+		if (out->size > 0) {
+			fn(context, out->data, out->size);
+		}
+		return 1;
+	}
+	if (lseek(out->fd, 0, SEEK_SET) != 0) {
+		return 0;
+	}
+	while ((n = read(out->fd, buf, sizeof(buf))) > 0) {
+		fn(context, buf, n);
+	}
+	lseek(out->fd, 0, SEEK_END);
+	return n == 0;
+}
+
+static void append_to_output(void *context, const char *data, size_t len)
+{
+	output_append(context, data, len);
+}
+
+/* Add the captured output src to dest. */
+void output_append_output(struct output *dest, struct output *src)
+{
+	if (!output_read(src, append_to_output, dest)) {
+		fatal("Failed to read %s (%s)", src->spill_path, strerror(errno));
+	}
+}
+
+static void write_to_fd(void *context, const char *data, size_t len)
+{
+	int fd = *(int *)context;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* Write captured output to a file descriptor. */
+void output_copy_to_fd(struct output *out, int fd)
+{
+	output_read(out, write_to_fd, &fd);
+}
+
+static void hash_output_data(void *context, const char *data, size_t len)
+{
+	hash_buffer(context, data, len);
+}
+
+/* Add captured output to the hash. Returns 1 on success, otherwise 0. */
+int output_hash(struct mdfour *md, struct output *out)
+{
+	return output_read(out, hash_output_data, md);
+}
+
+/*
+ * Store captured output in a file, optionally compressed. Returns 0 on
+ * success, otherwise -1.
+ */
+int output_save(struct output *out, const char *path, int compress)
+{
+	int ret;
+
+	if (out->fd == -1) {
+		return write_file(path, out->data, out->size, compress);
+	}
+	close(out->fd);
+	out->fd = -1;
+	ret = move_file(out->spill_path, path, compress);
+	unlink(out->spill_path);
+	free(out->data);
+	out->data = NULL;
+	out->size = 0;
+	return ret;
+}
+
+#ifdef HAVE_POSIX_SPAWN
+extern char **environ;
+
+/*
+ * Start the process with posix_spawn(), which doesn't have to copy the page
+ * tables of a large process like fork() does. Returns the pid of the process
+ * or -1 if it couldn't be started.
+ */
+static pid_t spawn(char **argv, int fd_stdout, int fd_stderr, int own_group)
 {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
 	pid_t pid;
-	int status;
+	int ret;
 
-	cc_log_executed_command(argv);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fd_stdout, 1);
+	posix_spawn_file_actions_adddup2(&actions, fd_stderr, 2);
+	posix_spawnattr_init(&attr);
+	if (own_group) {
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+		posix_spawnattr_setpgroup(&attr, 0);
+	}
+	ret = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ret != 0) {
+		cc_log("Failed to execute %s: %s", argv[0], strerror(ret));
+		return -1;
+	}
+	return pid;
+}
+#else
+/* Start the process with fork() and execv(). Returns the pid. */
+static pid_t spawn(char **argv, int fd_stdout, int fd_stderr, int own_group)
+{
+	pid_t pid;
 
 	pid = fork();
 	if (pid == -1) fatal("Failed to fork");
 
 	if (pid == 0) {
-		int fd;
+		if (own_group) {
+			setpgid(0, 0);
+		}
+		dup2(fd_stdout, 1);
+		dup2(fd_stderr, 2);
+		_exit(execv(argv[0], argv));
+	}
 
-		unlink(path_stdout);
-		fd = open(path_stdout, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL|O_BINARY, 0666);
-		if (fd == -1) {
-			exit(1);
+	if (own_group) {
+		/* Also here, so that the group exists once we return. */
+		setpgid(pid, pid);
+	}
+	return pid;
+}
+#endif
+
+/* Read from the pipes of a process until both are closed. */
+static void capture(int fd_out, struct output *out,
+		    int fd_err, struct output *err)
+{
+	struct pollfd pfd[2];
+	struct output *outputs[2];
+	char buf[10240];
+	ssize_t n;
+	int i;
+
+	pfd[0].fd = fd_out;
+	pfd[0].events = POLLIN;
+	outputs[0] = out;
+	pfd[1].fd = fd_err;
+	pfd[1].events = POLLIN;
+	outputs[1] = err;
+	while (pfd[0].fd != -1 || pfd[1].fd != -1) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fatal("poll failed (%s)", strerror(errno));
+		}
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].fd == -1 || !pfd[i].revents) {
+				continue;
+			}
+			n = read(pfd[i].fd, buf, sizeof(buf));
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				continue;
+			}
+			output_append(outputs[i], buf, n);
 		}
-		dup2(fd, 1);
-		close(fd);
+	}
+}
 
-		unlink(path_stderr);
-		fd = open(path_stderr, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL|O_BINARY, 0666);
-		if (fd == -1) {
-			exit(1);
+/* Create a pipe whose descriptors are closed in the executed process. */
+static void create_pipe(int fds[2])
+{
+	if (pipe(fds) != 0) {
+		fatal("Failed to create pipe (%s)", strerror(errno));
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Start a compiler backend like execute() does, without waiting for it. If
+ * own_group is true, the process gets a process group of its own so that
+ * execute_kill() also reaches the processes it starts in turn, like the cc1
+ * of a gcc driver. Returns 0 if the process was started, otherwise the status
+ * that execute() would have returned.
+ */
+int execute_start(char **argv,
+		  const char *path_stdout,
+		  int own_group,
+		  struct process *proc)
+{
+	int out_pipe[2] = { -1, -1 };
+	int err_pipe[2];
+	int fd_stdout;
+
+	cc_log_executed_command(argv);
+
+	if (path_stdout) {
+		unlink(path_stdout);
+		fd_stdout = open(path_stdout,
+				 O_WRONLY|O_CREAT|O_TRUNC|O_EXCL|O_BINARY,
+				 0666);
+		if (fd_stdout == -1) {
+			/* Like a child that failed to create the file. */
+			return 1;
 		}
-		dup2(fd, 2);
-		close(fd);
+		fcntl(fd_stdout, F_SETFD, FD_CLOEXEC);
+	} else {
+		create_pipe(out_pipe);
+		fd_stdout = out_pipe[1];
+	}
+	create_pipe(err_pipe);
 
-		exit(execv(argv[0], argv));
+	proc->pid = spawn(argv, fd_stdout, err_pipe[1], own_group);
+	proc->own_group = own_group;
+	close(fd_stdout);
+	close(err_pipe[1]);
+	if (proc->pid == -1) {
+		/* Like a forked child whose execv() failed. */
+		if (out_pipe[0] != -1) {
+			close(out_pipe[0]);
+		}
+		close(err_pipe[0]);
+		return 255;
 	}
+	proc->fd_out = out_pipe[0];
+	proc->fd_err = err_pipe[0];
+	return 0;
+}
+
+/*
+ * Wait for a process started by execute_start(), capturing its output like
+ * execute() does. Returns the exit status as execute() does.
+ */
+int execute_finish(struct process *proc, struct output *out, struct output *err)
+{
+	int status;
+
+	capture(proc->fd_out, out, proc->fd_err, err);
 
-	if (waitpid(pid, &status, 0) != pid) {
+	if (waitpid(proc->pid, &status, 0) != proc->pid) {
 		fatal("waitpid failed");
 	}
 
@@ -77,6 +372,37 @@ int execute(char **argv,
 	return WEXITSTATUS(status);
 }
 
+/* Terminate a process started by execute_start() whose output isn't needed. */
+void execute_kill(struct process *proc)
+{
+	kill(proc->own_group ? -proc->pid : proc->pid, SIGTERM);
+	if (proc->fd_out != -1) {
+		close(proc->fd_out);
+	}
+	close(proc->fd_err);
+	waitpid(proc->pid, NULL, 0);
+}
+
+/*
+  execute a compiler backend, capturing stderr in err and stdout in the file
+  path_stdout or, if path_stdout is NULL, in out
+  the full path to the compiler to run is in argv[0]
+*/
+int execute(char **argv,
+	    const char *path_stdout,
+	    struct output *out,
+	    struct output *err)
+{
+	struct process proc;
+	int status;
+
+	status = execute_start(argv, path_stdout, 0, &proc);
+	if (status != 0) {
+		return status;
+	}
+	return execute_finish(&proc, out, err);
+}
+
 
 /*
   find an executable by name in $PATH. Exclude any that are links to exclude_name
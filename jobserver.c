@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2010 Joel Rosdahl
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Participation in the GNU make jobserver. A make started with -jN passes a
+ * pipe or named FIFO holding N-1 tokens (bytes) to the commands it runs, and
+ * a command that wants to run more than one process at a time takes a token
+ * for each extra process and writes it back when the process is done. ccache
+ * takes tokens for work that it does besides the compilation it was asked
+ * for, so that a build stays within its parallelism budget.
+ *
+ * The jobserver is found in MAKEFLAGS as --jobserver-auth=R,W (or the older
+ * --jobserver-fds=R,W) with inherited file descriptors R and W, or as
+ * --jobserver-auth=fifo:PATH.
+ */
+
+#include "ccache.h"
+#include "jobserver.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int initialized;
+
+/* Descriptors to take and return tokens with, or -1 without a jobserver. */
+static int read_fd = -1;
+static int write_fd = -1;
+
+/* The tokens taken, to be written back as they were. */
+static char *tokens;
+static size_t n_tokens;
+
+/* Return whether fd is an inherited pipe or FIFO. */
+static int is_fifo_fd(int fd)
+{
+	struct stat st;
+
+	return fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/*
+ * Open a descriptor of the inherited pipe fd that reads without blocking.
+ * Setting O_NONBLOCK on fd itself would affect make and the other commands,
+ * which share its open file description.
+ */
+static int reopen_nonblocking(int fd)
+{
+	char *path;
+	int new_fd;
+
+	x_asprintf(&path, "/proc/self/fd/%d", fd);
+	new_fd = open(path, O_RDONLY | O_NONBLOCK);
+	free(path);
+	return new_fd;
+}
+
+static void init(void)
+{
+	const char *makeflags, *p, *auth = NULL;
+	char *value, *end;
+	int fds[2];
+
+	initialized = 1;
+	makeflags = getenv("MAKEFLAGS");
+	if (!makeflags) {
+		return;
+	}
+	/* The last occurrence is the one from the innermost make. */
+	for (p = makeflags; (p = strstr(p, "--jobserver-")); p++) {
+		if (strncmp(p, "--jobserver-auth=", 17) == 0) {
+			auth = p + 17;
+		} else if (strncmp(p, "--jobserver-fds=", 16) == 0) {
+			auth = p + 16;
+		}
+	}
+	if (!auth) {
+		return;
+	}
+	value = x_strndup(auth, strcspn(auth, " "));
+
+	if (strncmp(value, "fifo:", 5) == 0) {
+		read_fd = open(value + 5, O_RDONLY | O_NONBLOCK);
+		if (read_fd != -1) {
+			write_fd = open(value + 5, O_WRONLY | O_NONBLOCK);
+		}
+		if (write_fd != -1) {
+			/* Unlike make's descriptors, ours aren't for the compiler. */
+			fcntl(write_fd, F_SETFD, FD_CLOEXEC);
+		}
+	} else {
+		fds[0] = strtol(value, &end, 10);
+		fds[1] = *end == ',' ? atoi(end + 1) : -1;
+		/* Without a + in the make rule, the descriptors are closed. */
+		if (is_fifo_fd(fds[0]) && is_fifo_fd(fds[1])) {
+			read_fd = reopen_nonblocking(fds[0]);
+			write_fd = fds[1];
+		}
+	}
+	if (read_fd == -1 || write_fd == -1) {
+		cc_log("Can't use the jobserver %s", value);
+		if (read_fd != -1) {
+			close(read_fd);
+		}
+		read_fd = -1;
+		write_fd = -1;
+	} else {
+		fcntl(read_fd, F_SETFD, FD_CLOEXEC);
+	}
+	free(value);
+}
+
+/*
+ * Ask for permission to run one more process, waiting at most timeout_ms
+ * milliseconds for it. Returns 1 if a token was taken or if there is no
+ * jobserver to limit the parallelism, otherwise 0.
+ */
+int jobserver_acquire(int timeout_ms)
+{
+	struct pollfd pfd;
+	time_t deadline;
+	char token;
+	ssize_t n;
+	int left;
+
+	if (!initialized) {
+		init();
+	}
+	if (read_fd == -1) {
+		return 1;
+	}
+
+	deadline = time(NULL) + (timeout_ms + 999) / 1000;
+	left = timeout_ms;
+	while (1) {
+		n = read(read_fd, &token, 1);
+		if (n == 1) {
+			tokens = x_realloc(tokens, n_tokens + 1);
+			tokens[n_tokens++] = token;
+			return 1;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			/* The jobserver is gone. */
+			return 1;
+		}
+		if (left <= 0) {
+			return 0;
+		}
+		pfd.fd = read_fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, left);
+		left = (int)(deadline - time(NULL)) * 1000;
+	}
+}
+
+/* Return a token taken by jobserver_acquire(), if any. */
+void jobserver_release(void)
+{
+	if (n_tokens == 0) {
+		return;
+	}
+	n_tokens--;
+	if (write(write_fd, &tokens[n_tokens], 1) != 1) {
+		cc_log("Failed to return a jobserver token (%s)",
+		       strerror(errno));
+	}
+}
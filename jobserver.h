@@ -0,0 +1,7 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+int jobserver_acquire(int timeout_ms);
+void jobserver_release(void);
+
+#endif
@@ -21,6 +21,7 @@
 #include "hashutil.h"
 #include "manifest.h"
 #include "murmurhashneutral2.h"
+#include "server.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -356,38 +357,73 @@ error:
 	return 0;
 }
 
+/*
+ * Hash a file found by a manifest. Returns 0 if the file can't be hashed or
+ * contains time macros.
+ */
+static int hash_manifest_file(const char *path, struct file_hash *actual)
+{
+	struct mdfour hash;
+	struct stat st;
+	int result;
+	int use_server = server_uses_file_identity();
+
+	/* Without the server, nothing needs the stat() result. */
+	if (use_server) {
+		if (stat(path, &st) != 0) {
+			cc_log("Failed to stat %s", path);
+			return 0;
+		}
+		if (server_file_hash(path, &st, actual)) {
+			return 1;
+		}
+	}
+	hash_start(&hash);
+	if (is_precompiled_header(path)) {
+		/* Not source code, so hashed by content only. */
+		if (!hash_file(&hash, path)) {
+			cc_log("Failed hashing %s", path);
+			return 0;
+		}
+		result = HASH_SOURCE_CODE_OK;
+	} else {
+		result = hash_source_code_file(&hash, path);
+		if (result & HASH_SOURCE_CODE_ERROR) {
+			cc_log("Failed hashing %s", path);
+			return 0;
+		}
+		if (result & HASH_SOURCE_CODE_FOUND_TIME) {
+			return 0;
+		}
+	}
+	hash_result_as_bytes(&hash, actual->hash);
+	actual->size = hash.totalN;
+	if (use_server && result == HASH_SOURCE_CODE_OK) {
+		server_record_file_hash(path, &st, actual);
+	}
+	return 1;
+}
+
 static int verify_object(struct manifest *mf, struct object *obj,
 			 struct hashtable *hashed_files)
 {
 	uint32_t i;
 	struct file_info *fi;
 	struct file_hash *actual;
-	struct mdfour hash;
-	int result;
+	char *path;
 
 	for (i = 0; i < obj->n_file_info_indexes; i++) {
 		fi = &mf->file_infos[obj->file_info_indexes[i]];
-		actual = hashtable_search(hashed_files, mf->files[fi->index]);
+		path = mf->files[fi->index];
+		actual = hashtable_search(hashed_files, path);
 		if (!actual) {
 			actual = x_malloc(sizeof(*actual));
-			hash_start(&hash);
-			result = hash_source_code_file(&hash,
-						       mf->files[fi->index]);
-			if (result & HASH_SOURCE_CODE_ERROR) {
-				cc_log("Failed hashing %s",
-				       mf->files[fi->index]);
-				free(actual);
-				return 0;
-			}
-			if (result & HASH_SOURCE_CODE_FOUND_TIME) {
+			if (!server_watched_file_hash(path, actual, NULL)
+			    && !hash_manifest_file(path, actual)) {
 				free(actual);
 				return 0;
 			}
-			hash_result_as_bytes(&hash, actual->hash);
-			actual->size = hash.totalN;
-			hashtable_insert(hashed_files,
-					 x_strdup(mf->files[fi->index]),
-					 actual);
+			hashtable_insert(hashed_files, x_strdup(path), actual);
 		}
 		if (memcmp(fi->hash, actual->hash, mf->hash_size) != 0
 		    || fi->size != actual->size) {
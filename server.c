@@ -0,0 +1,1061 @@
+/*
+ * Copyright (C) 2010 Joel Rosdahl
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * A ccache server keeps what compilations can share in memory. When
+ * CCACHE_SERVER names the socket of a running server, ccache sends its
+ * arguments, working directory, environment and standard file descriptors to
+ * the server instead of doing the compilation itself, and exits with the
+ * status that the server sends back.
+ *
+ * The server forks a handler for each connection, and the handler forks a
+ * worker that runs the normal ccache code with the client's file descriptors,
+ * working directory and environment. ccache keeps the state of a compilation
+ * in globals and ends by exiting or by executing the real compiler, so a
+ * worker can't be reused; the handler waits for it and sends its exit status
+ * to the client.
+ *
+ * Workers inherit the server's memory and thereby the hashes of the include
+ * files that earlier workers have hashed. Workers report new hashes to the
+ * server through a pipe.
+ *
+ * Where inotify is available, the server also watches the directories of the
+ * reported files and forgets a hash as soon as its file changes. Workers can
+ * then use the hash of a watched file without looking at the file at all.
+ */
+
+#include "ccache.h"
+#include "hashtable.h"
+#include "jobserver.h"
+#include "server.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
+
+extern char **environ;
+extern unsigned sloppiness;
+
+#define SERVER_MAGIC 0x63437376 /* "cCsv" */
+
+/* Requests larger than this are rejected as garbage. */
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+
+/* The client's standard input, output and error are passed to the server. */
+#define NUM_PASSED_FDS 3
+
+struct request_header {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t umask;
+	uint32_t size; /* Of the strings that follow: cwd, argv and environment. */
+};
+
+/*
+ * A file whose hash is known, identified well enough to notice changes. In
+ * the pipe, each report is followed by the path of the file.
+ */
+struct hash_report {
+	uint32_t size; /* Of the report including the path and its NUL. */
+	uint32_t watched; /* Set by the server if changes will be noticed. */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t file_size;
+	int64_t mtime;
+	int64_t ctime;
+	struct file_hash hash;
+};
+
+/* Path -> struct hash_report of the files whose hashes are known. */
+static struct hashtable *known_files;
+
+/* Write end of the pipe that workers report new hashes through. */
+static int report_fd = -1;
+
+/* Whether this process runs a compilation for a client. */
+static int worker;
+
+static volatile sig_atomic_t stop_server;
+
+/* Pipe that a handler's SIGCHLD handler writes to. */
+static int child_pipe[2] = { -1, -1 };
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Events that may change the content of a file in a directory. */
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE \
+		     | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | TREE_EVENTS)
+
+/* Events that may change which file a path below a directory refers to. */
+#define TREE_EVENTS (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		     | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Types of file systems where changes may be made by other machines. */
+static const unsigned long remote_fs_types[] = {
+	0x6969,     /* NFS */
+	0x517B,     /* SMB */
+	0xFF534D42, /* CIFS */
+	0xFE534D42, /* SMB2 */
+	0x65735546, /* FUSE */
+	0x5346414F, /* AFS */
+	0x73757245, /* Coda */
+	0x01021997, /* 9P */
+	0x00C36400, /* Ceph */
+};
+
+static int inotify_fd = -1;
+
+/* Watch descriptor -> path of the watched directory. */
+static char **watched_dirs;
+static int n_watched_dirs;
+#endif
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Send data together with the file descriptors to pass. */
+static int send_with_fds(int sock, const void *data, size_t len,
+			 const int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(NUM_PASSED_FDS * sizeof(int))];
+	} control;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(NUM_PASSED_FDS * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, NUM_PASSED_FDS * sizeof(int));
+
+	return sendmsg(sock, &msg, 0) == (ssize_t)len;
+}
+
+/* Receive data sent by send_with_fds(). */
+static int receive_with_fds(int sock, void *data, size_t len, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(NUM_PASSED_FDS * sizeof(int))];
+	} control;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(sock, &msg, 0);
+	if (n <= 0) {
+		return 0;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg
+	    || cmsg->cmsg_level != SOL_SOCKET
+	    || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(NUM_PASSED_FDS * sizeof(int))) {
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), NUM_PASSED_FDS * sizeof(int));
+
+	return read_all(sock, (char *)data + n, len - n);
+}
+
+static int connect_server(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Copy a string with its NUL to p and return the position after it. */
+static char *add_string(char *p, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+/*
+ * Let the server at CCACHE_SERVER do the compilation. Returns the exit status
+ * of the compilation, or -1 if there is no server to do it.
+ */
+int server_forward(int argc, char *argv[])
+{
+	static const int fds[NUM_PASSED_FDS] = { 0, 1, 2 };
+	struct request_header header;
+	const char *path;
+	char *cwd, *buf, *p;
+	size_t size;
+	int32_t status;
+	mode_t mask;
+	int fd, i, envc;
+
+	path = getenv("CCACHE_SERVER");
+	if (!path || worker) {
+		return -1;
+	}
+	if (getenv("UNCACHED_ERR_FD")) {
+		/* It refers to a file descriptor of this process. */
+		return -1;
+	}
+	fd = connect_server(path);
+	if (fd == -1) {
+		return -1;
+	}
+
+	cwd = get_cwd();
+	size = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	for (envc = 0; environ[envc]; envc++) {
+		size += strlen(environ[envc]) + 1;
+	}
+	buf = x_malloc(size);
+	p = add_string(buf, cwd);
+	for (i = 0; i < argc; i++) {
+		p = add_string(p, argv[i]);
+	}
+	for (i = 0; i < envc; i++) {
+		p = add_string(p, environ[i]);
+	}
+	free(cwd);
+
+	mask = umask(0);
+	umask(mask);
+
+	header.magic = SERVER_MAGIC;
+	header.argc = argc;
+	header.envc = envc;
+	header.umask = mask;
+	header.size = size;
+	if (!send_with_fds(fd, &header, sizeof(header), fds)
+	    || !write_all(fd, buf, size)) {
+		/* Nothing has been done yet, so compile without the server. */
+		free(buf);
+		close(fd);
+		return -1;
+	}
+	free(buf);
+
+	if (!read_all(fd, &status, sizeof(status))) {
+		fatal("Lost connection to the ccache server at %s", path);
+	}
+	close(fd);
+	return status;
+}
+
+/* Return whether this process runs a compilation for a client. */
+int in_server(void)
+{
+	return worker;
+}
+
+/*
+ * Return whether the server can make use of the identity of files, i.e.
+ * whether stat() results are worth passing to server_file_hash() and
+ * server_record_file_hash().
+ */
+int server_uses_file_identity(void)
+{
+	return worker || known_files;
+}
+
+static void set_identity(struct hash_report *report, const struct stat *st)
+{
+	report->dev = st->st_dev;
+	report->ino = st->st_ino;
+	report->file_size = st->st_size;
+	report->mtime = st->st_mtime;
+	report->ctime = st->st_ctime;
+}
+
+/*
+ * Look up the hash of a file in the server's memory. st is the result of
+ * stat() on the file. Returns 0 if the hash isn't known.
+ */
+int server_file_hash(const char *path, const struct stat *st,
+		     struct file_hash *hash)
+{
+	struct hash_report *known, identity;
+
+	if (!known_files) {
+		return 0;
+	}
+	known = hashtable_search(known_files, (void *)path);
+	if (!known) {
+		return 0;
+	}
+	set_identity(&identity, st);
+	if (known->dev != identity.dev
+	    || known->ino != identity.ino
+	    || known->file_size != identity.file_size
+	    || known->mtime != identity.mtime
+	    || known->ctime != identity.ctime) {
+		return 0;
+	}
+	*hash = known->hash;
+	return 1;
+}
+
+/*
+ * Look up the hash of a file that the server watches for changes, without
+ * looking at the file. The modification time of the file is stored in mtime
+ * unless it is NULL. Returns 0 if the file isn't watched.
+ */
+int server_watched_file_hash(const char *path, struct file_hash *hash,
+			     time_t *mtime)
+{
+	struct hash_report *known;
+
+	if (!known_files) {
+		return 0;
+	}
+	known = hashtable_search(known_files, (void *)path);
+	if (!known || !known->watched) {
+		return 0;
+	}
+	*hash = known->hash;
+	if (mtime) {
+		*mtime = known->mtime;
+	}
+	return 1;
+}
+
+/*
+ * Tell the server the hash of a file that hashed without errors or time
+ * macros. st is the result of stat() on the file before it was hashed.
+ */
+void server_record_file_hash(const char *path, const struct stat *st,
+			     const struct file_hash *hash)
+{
+	char buf[PIPE_BUF];
+	struct hash_report report;
+	size_t len = strlen(path) + 1;
+	time_t now = time(NULL);
+
+	if (!worker || report_fd == -1) {
+		return;
+	}
+	if (sloppiness & SLOPPY_TIME_MACROS) {
+		/* The hash may lack the date that others need. */
+		return;
+	}
+	if (st->st_mtime >= now || st->st_ctime >= now) {
+		/* It may change again this second without looking changed. */
+		return;
+	}
+	if (sizeof(report) + len > sizeof(buf)) {
+		return;
+	}
+
+	memset(&report, 0, sizeof(report));
+	report.size = sizeof(report) + len;
+	set_identity(&report, st);
+	report.hash = *hash;
+	memcpy(buf, &report, sizeof(report));
+	memcpy(buf + sizeof(report), path, len);
+
+	/* Written atomically; dropped if the pipe is full. */
+	if (write(report_fd, buf, report.size) != (ssize_t)report.size) {
+		cc_log("Failed to report hash of %s to the server", path);
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int is_remote_fs(const char *dir)
+{
+	struct statfs fs;
+	size_t i;
+
+	if (statfs(dir, &fs) != 0) {
+		return 1;
+	}
+	for (i = 0; i < sizeof(remote_fs_types) / sizeof(remote_fs_types[0]);
+	     i++) {
+		if ((unsigned long)fs.f_type == remote_fs_types[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int add_watch(const char *dir, uint32_t events)
+{
+	int wd, i;
+
+	wd = inotify_add_watch(inotify_fd, dir, events | IN_MASK_ADD | IN_ONLYDIR);
+	if (wd < 0) {
+		return 0;
+	}
+	if (wd >= n_watched_dirs) {
+		i = n_watched_dirs;
+		n_watched_dirs = wd + 100;
+		watched_dirs = x_realloc(watched_dirs,
+					 n_watched_dirs * sizeof(*watched_dirs));
+		for (; i < n_watched_dirs; i++) {
+			watched_dirs[i] = NULL;
+		}
+	}
+	if (!watched_dirs[wd]) {
+		watched_dirs[wd] = x_strdup(dir);
+	}
+	return 1;
+}
+
+/*
+ * Watch a reported file and the directories above it. Returns whether every
+ * change of the file from now on will be noticed.
+ */
+static int watch_file(const char *path, const struct hash_report *report)
+{
+	struct hash_report identity;
+	struct stat st;
+	char *real, *dir, *parent;
+	int ok;
+
+	if (inotify_fd == -1) {
+		return 0;
+	}
+
+	/* Only a path without symbolic links is watched by its directories. */
+	real = x_realpath(path);
+	ok = real && strcmp(real, path) == 0;
+	free(real);
+	if (!ok) {
+		return 0;
+	}
+
+	dir = dirname((char *)path);
+	if (strcmp(dir, "") == 0) {
+		free(dir);
+		dir = x_strdup("/");
+	}
+	if (is_remote_fs(dir)) {
+		free(dir);
+		return 0;
+	}
+	ok = add_watch(dir, FILE_EVENTS);
+	while (ok && strcmp(dir, "/") != 0) {
+		parent = dirname(dir);
+		if (strcmp(parent, "") == 0) {
+			free(parent);
+			parent = x_strdup("/");
+		}
+		free(dir);
+		dir = parent;
+		ok = add_watch(dir, TREE_EVENTS);
+	}
+	free(dir);
+	if (!ok) {
+		return 0;
+	}
+
+	/*
+	 * A change before the watches were added would go unnoticed. Writes
+	 * through other hard links aren't seen by the watches either.
+	 */
+	if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+		return 0;
+	}
+	set_identity(&identity, &st);
+	return identity.dev == report->dev
+		&& identity.ino == report->ino
+		&& identity.file_size == report->file_size
+		&& identity.mtime == report->mtime
+		&& identity.ctime == report->ctime;
+}
+
+static void forget_known_files(void)
+{
+	hashtable_destroy(known_files, 1);
+	known_files = create_hashtable(1000, hash_from_string, strings_equal);
+}
+
+/* Forget the hashes of the files that have changed. */
+static void read_file_events(void)
+{
+	union {
+		struct inotify_event event;
+		char buf[16384];
+	} events;
+	struct inotify_event *event;
+	char *p, *path;
+	const char *dir;
+	ssize_t n;
+
+	while ((n = read(inotify_fd, events.buf, sizeof(events.buf))) > 0) {
+		for (p = events.buf; p < events.buf + n;
+		     p += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (event->mask & IN_IGNORED
+			    && event->wd < n_watched_dirs) {
+				free(watched_dirs[event->wd]);
+				watched_dirs[event->wd] = NULL;
+			}
+			if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED
+					   | IN_UNMOUNT | IN_DELETE_SELF
+					   | IN_MOVE_SELF)
+			    || (event->mask & IN_ISDIR
+				&& event->mask & TREE_EVENTS)) {
+				/* Paths below a directory may have changed. */
+				forget_known_files();
+				continue;
+			}
+			if (event->len == 0 || event->wd >= n_watched_dirs
+			    || !watched_dirs[event->wd]) {
+				continue;
+			}
+			dir = watched_dirs[event->wd];
+			x_asprintf(&path, "%s%s%s", dir,
+				   strcmp(dir, "/") == 0 ? "" : "/",
+				   event->name);
+			free(hashtable_remove(known_files, path));
+			free(path);
+		}
+	}
+}
+#endif
+
+/* Read the hashes that workers have reported. */
+static void read_reports(int fd)
+{
+	static char buf[65536];
+	static size_t len;
+	struct hash_report report, *known;
+	char *path;
+	size_t pos = 0;
+	ssize_t n;
+
+	n = read(fd, buf + len, sizeof(buf) - len);
+	if (n <= 0) {
+		return;
+	}
+	len += n;
+
+	while (len - pos >= sizeof(report)) {
+		memcpy(&report, buf + pos, sizeof(report));
+		if (report.size <= sizeof(report) || report.size > PIPE_BUF) {
+			/* Can't happen since reports are written whole. */
+			cc_log("Corrupt hash report; forgetting pending reports");
+			len = 0;
+			return;
+		}
+		if (len - pos < report.size) {
+			break;
+		}
+		path = buf + pos + sizeof(report);
+		path[report.size - sizeof(report) - 1] = '\0';
+		known = hashtable_search(known_files, path);
+		if (!known) {
+			known = x_malloc(sizeof(*known));
+			hashtable_insert(known_files, x_strdup(path), known);
+		}
+		*known = report;
+		known->watched = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+		known->watched = watch_file(path, known);
+#endif
+		pos += report.size;
+	}
+	memmove(buf, buf + pos, len - pos);
+	len -= pos;
+}
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	stop_server = 1;
+}
+
+static void handle_child_exit(int sig)
+{
+	int saved_errno = errno;
+
+	(void)sig;
+	if (write(child_pipe[1], "", 1) == -1) {
+		/* A wakeup is pending anyway. */
+	}
+	errno = saved_errno;
+}
+
+/* Run the compilation of a request. Never returns. */
+static void run_worker(int conn, int *fds, const char *cwd, mode_t mask,
+		       int argc, char **argv, char **env,
+		       int (*compile)(int argc, char *argv[]))
+{
+	int i;
+
+	worker = 1;
+	signal(SIGCHLD, SIG_DFL);
+	close(child_pipe[0]);
+	close(child_pipe[1]);
+	close(conn);
+
+	for (i = 0; i < NUM_PASSED_FDS; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	if (chdir(cwd) != 0) {
+		fprintf(stderr, "ccache: failed to change directory to %s (%s)\n",
+			cwd, strerror(errno));
+		_exit(1);
+	}
+	umask(mask);
+	environ = env;
+
+	exit(compile(argc, argv));
+}
+
+/*
+ * Serve a connection: receive the request, run it in a worker and send the
+ * worker's exit status back. Never returns.
+ */
+static void handle_connection(int conn,
+			      int (*compile)(int argc, char *argv[]))
+{
+	struct request_header header;
+	struct pollfd pfd[2];
+	int fds[NUM_PASSED_FDS];
+	char **argv, **env;
+	char *buf, *cwd, *p, *end;
+	int32_t result;
+	int status;
+	pid_t pid, ret;
+	unsigned i;
+
+	if (!receive_with_fds(conn, &header, sizeof(header), fds)
+	    || header.magic != SERVER_MAGIC
+	    || header.size > MAX_REQUEST_SIZE
+	    || header.argc == 0
+	    || header.argc > header.size
+	    || header.envc > header.size) {
+		cc_log("Invalid request");
+		_exit(1);
+	}
+	buf = x_malloc(header.size + 1);
+	if (!read_all(conn, buf, header.size)) {
+		_exit(1);
+	}
+	buf[header.size] = '\0';
+
+	/* Unpack the strings. */
+	p = buf;
+	end = buf + header.size;
+	cwd = p;
+	p += strlen(p) + 1;
+	argv = x_malloc((header.argc + 1) * sizeof(*argv));
+	for (i = 0; i < header.argc; i++) {
+		if (p >= end) {
+			_exit(1);
+		}
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+	argv[header.argc] = NULL;
+	env = x_malloc((header.envc + 1) * sizeof(*env));
+	for (i = 0; i < header.envc; i++) {
+		if (p >= end) {
+			_exit(1);
+		}
+		env[i] = p;
+		p += strlen(p) + 1;
+	}
+	env[header.envc] = NULL;
+
+	if (pipe(child_pipe) != 0) {
+		_exit(1);
+	}
+	signal(SIGCHLD, handle_child_exit);
+	pid = fork();
+	if (pid == -1) {
+		_exit(1);
+	}
+	if (pid == 0) {
+		run_worker(conn, fds, cwd, header.umask, header.argc, argv,
+			   env, compile);
+	}
+	for (i = 0; i < NUM_PASSED_FDS; i++) {
+		close(fds[i]);
+	}
+
+	/* Wait for the worker, stopping it if the client goes away. */
+	pfd[0].fd = child_pipe[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = conn;
+	pfd[1].events = POLLIN;
+	while ((ret = waitpid(pid, &status, WNOHANG)) == 0) {
+		if (poll(pfd, 2, -1) > 0 && pfd[1].revents) {
+			/* The client sends nothing more, so it hung up. */
+			kill(pid, SIGTERM);
+			pfd[1].fd = -1;
+		}
+	}
+	if (ret != pid) {
+		result = 1;
+	} else if (WIFEXITED(status)) {
+		result = WEXITSTATUS(status);
+	} else {
+		result = 128 + WTERMSIG(status);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	write_all(conn, &result, sizeof(result));
+	_exit(0);
+}
+
+/*
+ * Set up the known files and the pipe that workers report hashes through.
+ * Returns the read end of the pipe.
+ */
+static int start_reports(void)
+{
+	int report_pipe[2];
+
+	if (pipe(report_pipe) != 0) {
+		fatal("Failed to create pipe (%s)", strerror(errno));
+	}
+	fcntl(report_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(report_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(report_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(report_pipe[1], F_SETFL, O_NONBLOCK);
+	report_fd = report_pipe[1];
+	known_files = create_hashtable(1000, hash_from_string, strings_equal);
+	return report_pipe[0];
+}
+
+/*
+ * Serve compilations on the Unix socket path until SIGTERM or SIGINT. Each
+ * request is run by calling compile with the client's arguments.
+ */
+int server_main(const char *path, int (*compile)(int argc, char *argv[]))
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfd[3];
+	int listen_fd, conn, fd;
+	int report_pipe_fd;
+	mode_t mask;
+	pid_t pid;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fatal("Socket path %s is too long", path);
+	}
+	fd = connect_server(path);
+	if (fd != -1) {
+		fatal("A server is already running at %s", path);
+	}
+
+	/* Received file descriptors must not end up as 0, 1 or 2. */
+	while ((fd = open("/dev/null", O_RDWR)) >= 0 && fd <= 2) {
+		/* Keep it. */
+	}
+	if (fd > 2) {
+		close(fd);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		fatal("Failed to create socket (%s)", strerror(errno));
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	mask = umask(077);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(listen_fd, SOMAXCONN) != 0) {
+		fatal("Failed to listen on %s (%s)", path, strerror(errno));
+	}
+	umask(mask);
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+	report_pipe_fd = start_reports();
+#ifdef HAVE_SYS_INOTIFY_H
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		cc_log("Failed to initialize inotify (%s)", strerror(errno));
+	}
+#endif
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	cc_log("Server listening on %s", path);
+
+	pfd[0].fd = listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = report_pipe_fd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+	pfd[2].fd = inotify_fd;
+#endif
+	pfd[2].events = POLLIN;
+	while (!stop_server) {
+		while (waitpid(-1, NULL, WNOHANG) > 0) {
+			/* Reap finished handlers. */
+		}
+		if (poll(pfd, 3, 1000) <= 0) {
+			continue;
+		}
+		if (pfd[1].revents & POLLIN) {
+			read_reports(report_pipe_fd);
+		}
+#ifdef HAVE_SYS_INOTIFY_H
+		if (pfd[2].revents & POLLIN) {
+			read_file_events();
+		}
+#endif
+		if (!(pfd[0].revents & POLLIN)) {
+			continue;
+		}
+		conn = accept(listen_fd, NULL, NULL);
+		if (conn == -1) {
+			continue;
+		}
+#ifdef HAVE_SYS_INOTIFY_H
+		/* The worker must not see hashes of files changed by now. */
+		if (inotify_fd != -1) {
+			read_file_events();
+		}
+#endif
+		pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			close(report_pipe_fd);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGINT, SIG_DFL);
+			handle_connection(conn, compile);
+		}
+		if (pid == -1) {
+			cc_log("Failed to fork (%s)", strerror(errno));
+		}
+		close(conn);
+	}
+
+	cc_log("Server stopping");
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
+
+/* Run a job of server_run_jobs(). Never returns. */
+static void run_job(const struct server_job *job, int report_pipe_fd,
+		    int (*compile)(int argc, char *argv[]))
+{
+	worker = 1;
+	signal(SIGCHLD, SIG_DFL);
+	close(child_pipe[0]);
+	close(child_pipe[1]);
+	close(report_pipe_fd);
+
+	if (chdir(job->directory) != 0) {
+		fprintf(stderr, "ccache: failed to change directory to %s (%s)\n",
+			job->directory, strerror(errno));
+		_exit(1);
+	}
+	exit(compile(job->argc, job->argv));
+}
+
+/*
+ * Run jobs by calling compile in forked workers, at most parallel at a time.
+ * Like in the server, workers share the hashes of include files. When run by
+ * make, each worker but the first also needs a jobserver token. Returns the
+ * number of jobs that failed.
+ */
+int server_run_jobs(const struct server_job *jobs, int n_jobs, int parallel,
+		    int (*compile)(int argc, char *argv[]))
+{
+	struct pollfd pfd[2];
+	pid_t *pids;
+	pid_t pid;
+	char buf[64];
+	int report_pipe_fd, status, running = 0, next = 0, failures = 0, i;
+	int extra = 0, waiting_for_token;
+
+	report_pipe_fd = start_reports();
+	if (pipe(child_pipe) != 0) {
+		fatal("Failed to create pipe (%s)", strerror(errno));
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(child_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(child_pipe[i], F_SETFL, O_NONBLOCK);
+	}
+	signal(SIGCHLD, handle_child_exit);
+	pids = x_malloc(n_jobs * sizeof(*pids));
+
+	pfd[0].fd = report_pipe_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = child_pipe[0];
+	pfd[1].events = POLLIN;
+	while (next < n_jobs || running > 0) {
+		waiting_for_token = 0;
+		while (running < parallel && next < n_jobs) {
+			if (running > 0) {
+				if (!jobserver_acquire(0)) {
+					waiting_for_token = 1;
+					break;
+				}
+				extra++;
+			}
+			/* Output of the parent must not be written twice. */
+			fflush(stdout);
+			fflush(stderr);
+			pid = fork();
+			if (pid == -1) {
+				fatal("Failed to fork (%s)", strerror(errno));
+			}
+			if (pid == 0) {
+				run_job(&jobs[next], report_pipe_fd, compile);
+			}
+			pids[next] = pid;
+			running++;
+			next++;
+		}
+
+		if (poll(pfd, 2, waiting_for_token ? 100 : -1) > 0) {
+			if (pfd[0].revents & POLLIN) {
+				read_reports(report_pipe_fd);
+			}
+			if (pfd[1].revents & POLLIN) {
+				while (read(child_pipe[0], buf, sizeof(buf)) > 0) {
+					/* Drain wakeups. */
+				}
+			}
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < next && pids[i] != pid; i++) {
+				/* Find the job. */
+			}
+			if (i == next) {
+				continue;
+			}
+			running--;
+			if (extra > 0) {
+				jobserver_release();
+				extra--;
+			}
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				continue;
+			}
+			failures++;
+			fprintf(stderr, "ccache: compilation of %s failed with"
+				" status %d\n", jobs[i].file,
+				WIFEXITED(status)
+				? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+		}
+	}
+
+	signal(SIGCHLD, SIG_DFL);
+	close(child_pipe[0]);
+	close(child_pipe[1]);
+	close(report_pipe_fd);
+	close(report_fd);
+	report_fd = -1;
+	free(pids);
+	return failures;
+}
@@ -0,0 +1,31 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "hashutil.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* A compilation to run in a directory. */
+struct server_job {
+	const char *directory;
+	const char *file; /* For messages. */
+	int argc;
+	char **argv;
+};
+
+int server_main(const char *path, int (*compile)(int argc, char *argv[]));
+int server_forward(int argc, char *argv[]);
+int server_run_jobs(const struct server_job *jobs, int n_jobs, int parallel,
+                    int (*compile)(int argc, char *argv[]));
+int in_server(void);
+int server_uses_file_identity(void);
+int server_file_hash(const char *path, const struct stat *st,
+                     struct file_hash *hash);
+int server_watched_file_hash(const char *path, struct file_hash *hash,
+                             time_t *mtime);
+void server_record_file_hash(const char *path, const struct stat *st,
+                             const struct file_hash *hash);
+
+#endif
@@ -19,14 +19,28 @@
 
 /*
  * Routines to handle the stats files The stats file is stored one per cache
- * subdirectory to make this more scalable.
+ * subdirectory to make this more scalable. The number of top-level cache
+ * subdirectories (shards) is fixed when the cache is created and recorded in
+ * the cache header file.
+ *
+ * A stats file is a struct stats_data: a header followed by STATS_SLOTS
+ * 64-bit counters in native byte order. Sizes are counted in bytes. Counters
+ * are updated in place through a shared mapping with atomic additions, so
+ * updates need no lock. Files in the old text format (space-separated decimal
+ * counters) and older binary versions, which counted sizes in KiB, are
+ * converted when they are first opened for writing.
  */
 
 #include "ccache.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,52 +49,279 @@
 extern char *stats_file;
 extern char *cache_dir;
 
-/* default maximum cache size */
+/* default maximum cache size in bytes */
 #ifndef DEFAULT_MAXSIZE
-#define DEFAULT_MAXSIZE (1024*1024)
+#define DEFAULT_MAXSIZE ((uint64_t)1024*1024*1024)
 #endif
 
+#define STATS_MAGIC 0x63437374 /* "cCst" */
+#define STATS_VERSION 3
+
+/* Number of counters in a stats file; room for STATS_END to grow. */
+#define STATS_SLOTS 64
+
+/* Number of latency histograms in a stats file; room for PHASE_END to grow. */
+#define PHASE_SLOTS 16
+
+/* Name of the file in the cache directory that records the cache layout. */
+#define CACHE_HEADER_NAME "header"
+
+/* Number of shards of caches without a header. */
+#define DEFAULT_SHARDS 16
+
+/* Size of a version 1 stats file, which had no latency histograms. */
+#define STATS_V1_SIZE (8 + 8 * STATS_SLOTS)
+
+struct stats_data {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t counters[STATS_SLOTS];
+	/*
+	 * Bucket i counts the phase durations d (in microseconds) with
+	 * 2^i <= d + 1 < 2^(i+1).
+	 */
+	uint64_t latency[PHASE_SLOTS][LATENCY_BUCKETS];
+};
+
+/* names of the phases in --show-latency output */
+static const char *phase_names[PHASE_END] = {
+	"common hash",
+	"direct lookup",
+	"preprocessor",
+	"cpp hashing",
+	"compiler",
+	"store",
+	"copy out",
+	"manifest update",
+	"cleanup"
+};
+
+/* names of the phases in --print-stats output */
+static const char *phase_ids[PHASE_END] = {
+	"common_hash",
+	"direct_lookup",
+	"preprocessor",
+	"cpp_hashing",
+	"compiler",
+	"store",
+	"copy_out",
+	"manifest_update",
+	"cleanup"
+};
+
 #define FLAG_NOZERO 1 /* don't zero with the -z option */
 #define FLAG_ALWAYS 2 /* always show, even if zero */
 
-static void display_size(size_t v);
+static void display_size(uint64_t v);
 
 /* statistics fields in display order */
 static struct {
 	enum stats stat;
+	char *name; /* for --print-stats */
 	char *message;
-	void (*fn)(size_t );
+	void (*fn)(uint64_t );
 	unsigned flags;
 } stats_info[] = {
-	{ STATS_CACHEHIT_DIR, "cache hit (direct)             ", NULL, FLAG_ALWAYS },
-	{ STATS_CACHEHIT_CPP, "cache hit (preprocessed)       ", NULL, FLAG_ALWAYS },
-	{ STATS_TOCACHE,      "cache miss                     ", NULL, FLAG_ALWAYS },
-	{ STATS_LINK,         "called for link                ", NULL, 0 },
-	{ STATS_MULTIPLE,     "multiple source files          ", NULL, 0 },
-	{ STATS_STDOUT,       "compiler produced stdout       ", NULL, 0 },
-	{ STATS_NOOUTPUT,     "compiler produced no output    ", NULL, 0 },
-	{ STATS_EMPTYOUTPUT,  "compiler produced empty output ", NULL, 0 },
-	{ STATS_STATUS,       "compile failed                 ", NULL, 0 },
-	{ STATS_ERROR,        "ccache internal error          ", NULL, 0 },
-	{ STATS_PREPROCESSOR, "preprocessor error             ", NULL, 0 },
-	{ STATS_COMPILER,     "couldn't find the compiler     ", NULL, 0 },
-	{ STATS_MISSING,      "cache file missing             ", NULL, 0 },
-	{ STATS_ARGS,         "bad compiler arguments         ", NULL, 0 },
-	{ STATS_SOURCELANG,   "unsupported source language    ", NULL, 0 },
-	{ STATS_CONFTEST,     "autoconf compile/link          ", NULL, 0 },
-	{ STATS_UNSUPPORTED,  "unsupported compiler option    ", NULL, 0 },
-	{ STATS_OUTSTDOUT,    "output to stdout               ", NULL, 0 },
-	{ STATS_DEVICE,       "output to a non-regular file   ", NULL, 0 },
-	{ STATS_NOINPUT,      "no input file                  ", NULL, 0 },
-	{ STATS_BADEXTRAFILE, "error hashing extra file       ", NULL, 0 },
-	{ STATS_NUMFILES,     "files in cache                 ", NULL, FLAG_NOZERO|FLAG_ALWAYS },
-	{ STATS_TOTALSIZE,    "cache size                     ", display_size , FLAG_NOZERO|FLAG_ALWAYS },
-	{ STATS_MAXFILES,     "max files                      ", NULL, FLAG_NOZERO },
-	{ STATS_MAXSIZE,      "max cache size                 ", display_size, FLAG_NOZERO },
-	{ STATS_NONE, NULL, NULL, 0 }
+	{ STATS_CACHEHIT_DIR, "direct_cache_hit",              "cache hit (direct)             ", NULL, FLAG_ALWAYS },
+	{ STATS_CACHEHIT_CPP, "preprocessed_cache_hit",        "cache hit (preprocessed)       ", NULL, FLAG_ALWAYS },
+	{ STATS_TOCACHE,      "cache_miss",                    "cache miss                     ", NULL, FLAG_ALWAYS },
+	{ STATS_LINK,         "called_for_link",               "called for link                ", NULL, 0 },
+	{ STATS_MULTIPLE,     "multiple_source_files",         "multiple source files          ", NULL, 0 },
+	{ STATS_STDOUT,       "compiler_produced_stdout",      "compiler produced stdout       ", NULL, 0 },
+	{ STATS_NOOUTPUT,     "compiler_produced_no_output",   "compiler produced no output    ", NULL, 0 },
+	{ STATS_EMPTYOUTPUT,  "compiler_produced_empty_output", "compiler produced empty output ", NULL, 0 },
+	{ STATS_STATUS,       "compile_failed",                "compile failed                 ", NULL, 0 },
+	{ STATS_ERROR,        "internal_error",                "ccache internal error          ", NULL, 0 },
+	{ STATS_PREPROCESSOR, "preprocessor_error",            "preprocessor error             ", NULL, 0 },
+	{ STATS_COMPILER,     "could_not_find_compiler",       "couldn't find the compiler     ", NULL, 0 },
+	{ STATS_MISSING,      "missing_cache_file",            "cache file missing             ", NULL, 0 },
+	{ STATS_ARGS,         "bad_compiler_arguments",        "bad compiler arguments         ", NULL, 0 },
+	{ STATS_SOURCELANG,   "unsupported_source_language",   "unsupported source language    ", NULL, 0 },
+	{ STATS_CONFTEST,     "autoconf_test",                 "autoconf compile/link          ", NULL, 0 },
+	{ STATS_UNSUPPORTED,  "unsupported_compiler_option",   "unsupported compiler option    ", NULL, 0 },
+	{ STATS_OUTSTDOUT,    "output_to_stdout",              "output to stdout               ", NULL, 0 },
+	{ STATS_DEVICE,       "output_to_a_non_file",          "output to a non-regular file   ", NULL, 0 },
+	{ STATS_NOINPUT,      "no_input_file",                 "no input file                  ", NULL, 0 },
+	{ STATS_BADEXTRAFILE, "error_hashing_extra_file",      "error hashing extra file       ", NULL, 0 },
+	{ STATS_NUMFILES,     "files_in_cache",                "files in cache                 ", NULL, FLAG_NOZERO|FLAG_ALWAYS },
+	{ STATS_TOTALSIZE,    "cache_size_bytes",              "cache size                     ", display_size , FLAG_NOZERO|FLAG_ALWAYS },
+	{ STATS_MAXFILES,     "max_files",                     "max files                      ", NULL, FLAG_NOZERO },
+	{ STATS_MAXSIZE,      "max_cache_size_bytes",          "max cache size                 ", display_size, FLAG_NOZERO },
+	{ STATS_NONE, NULL, NULL, NULL, 0 }
 };
 
-static void display_size(size_t v)
+/* Check whether n is a supported number of shards: 16, 256 or 4096. */
+static int valid_shards(unsigned n)
+{
+	return n == 16 || n == 256 || n == 4096;
+}
+
+/* Read the number of shards from a cache header. Returns 0 on failure. */
+static unsigned read_cache_header(const char *path)
+{
+	FILE *f;
+	unsigned n;
+
+	f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	if (fscanf(f, "shards %u", &n) != 1 || !valid_shards(n)) {
+		cc_log("Invalid cache header %s", path);
+		n = 0;
+	}
+	fclose(f);
+	return n;
+}
+
+/* Number of shards of the cache, once known. */
+static unsigned shards;
+
+/* Whether the cache header exists, i.e. shards has been recorded. */
+static int have_header;
+
+/* Return the number of shards that a new cache gets from CCACHE_SHARDS. */
+static unsigned configured_shards(void)
+{
+	const char *env = getenv("CCACHE_SHARDS");
+	unsigned n;
+
+	if (!env) {
+		return DEFAULT_SHARDS;
+	}
+	n = atoi(env);
+	if (!valid_shards(n)) {
+		cc_log("Ignoring invalid CCACHE_SHARDS value %s", env);
+		return DEFAULT_SHARDS;
+	}
+	return n;
+}
+
+/*
+ * Check whether the cache directory holds anything that depends on the
+ * number of shards, i.e. anything but the header, the temporary directory,
+ * CACHEDIR.TAG and the top-level stats file.
+ */
+static int cache_dir_in_use(void)
+{
+	DIR *d;
+	struct dirent *de;
+	int in_use = 0;
+
+	d = opendir(cache_dir);
+	if (!d) {
+		return 0;
+	}
+	while (!in_use && (de = readdir(d))) {
+		in_use = strcmp(de->d_name, ".") != 0
+			 && strcmp(de->d_name, "..") != 0
+			 && strncmp(de->d_name, CACHE_HEADER_NAME,
+				    strlen(CACHE_HEADER_NAME)) != 0
+			 && strcmp(de->d_name, "tmp") != 0
+			 && strcmp(de->d_name, "CACHEDIR.TAG") != 0
+			 && strcmp(de->d_name, "stats") != 0;
+	}
+	closedir(d);
+	return in_use;
+}
+
+/*
+ * Return the number of shards of the cache. A new cache gets the number in
+ * CCACHE_SHARDS (16 by default), which create_cache_header() records for
+ * other invocations to follow. Caches from before headers existed have 16.
+ * Nothing is written here, so read-only operations stay read-only.
+ */
+int cache_shards(void)
+{
+	char *path;
+
+	if (shards) {
+		return shards;
+	}
+	if (!cache_dir) {
+		return DEFAULT_SHARDS;
+	}
+
+	x_asprintf(&path, "%s/%s", cache_dir, CACHE_HEADER_NAME);
+	shards = read_cache_header(path);
+	if (shards) {
+		have_header = 1;
+	} else if (cache_dir_in_use()) {
+		/* The header may have been created while looking. */
+		shards = read_cache_header(path);
+		have_header = shards != 0;
+		if (!shards) {
+			shards = DEFAULT_SHARDS;
+		}
+	}
+	free(path);
+
+	/* A new cache isn't settled until its header is created. */
+	return shards ? shards : configured_shards();
+}
+
+/*
+ * Record the number of shards in the cache header unless it's already there.
+ * Called before the first write to the cache, so that all invocations agree
+ * on its layout.
+ */
+void create_cache_header(void)
+{
+	char *path, *tmp;
+	unsigned n, existing;
+	FILE *f;
+
+	n = cache_shards();
+	if (have_header || !cache_dir || create_dir(cache_dir) != 0) {
+		return;
+	}
+
+	x_asprintf(&path, "%s/%s", cache_dir, CACHE_HEADER_NAME);
+	x_asprintf(&tmp, "%s.tmp.%s", path, tmp_string());
+	f = fopen(tmp, "w");
+	if (f) {
+		fprintf(f, "shards %u\n", n);
+		/* Whoever links the header into place first decides. */
+		if (fclose(f) == 0 && link(tmp, path) != 0) {
+			if (errno == EEXIST
+			    && (existing = read_cache_header(path))) {
+				n = existing;
+			} else {
+				cc_log("Failed to create %s (%s)", path,
+				       strerror(errno));
+			}
+		}
+		unlink(tmp);
+	}
+	shards = n;
+	have_header = 1;
+	free(tmp);
+	free(path);
+}
+
+/* Return the number of hex digits in the names of shards. */
+int shard_width(void)
+{
+	switch (cache_shards()) {
+	case 4096:
+		return 3;
+	case 256:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Return the path of a shard of the cache directory dir. Caller frees. */
+char *shard_dir(const char *dir, int shard)
+{
+	char *path;
+
+	x_asprintf(&path, "%s/%0*x", dir, shard_width(), shard);
+	return path;
+}
+
+static void display_size(uint64_t v)
 {
 	char *s = format_size(v);
 	printf("%15s", s);
@@ -88,68 +329,335 @@ static void display_size(size_t v)
 }
 
 /* parse a stats file from a buffer - adding to the counters */
-static void parse_stats(unsigned counters[STATS_END], char *buf)
+static void parse_stats(uint64_t counters[STATS_END], char *buf)
 {
 	int i;
 	char *p, *p2;
 
 	p = buf;
 	for (i=0;i<STATS_END;i++) {
-		counters[i] += strtol(p, &p2, 10);
+		counters[i] += strtoull(p, &p2, 10);
 		if (!p2 || p2 == p) break;
 		p = p2;
 	}
 }
 
-/* write out a stats file */
-static void write_stats(int fd, unsigned counters[STATS_END])
+/* fill in some default stats values */
+static void stats_default(uint64_t counters[STATS_END])
 {
-	int i;
-	int len = 0;
-	char buf[1024];
+	counters[STATS_MAXSIZE] += DEFAULT_MAXSIZE / cache_shards();
+}
 
-	for (i=0;i<STATS_END;i++) {
-		len += snprintf(buf+len, sizeof(buf)-(len+1), "%u ", counters[i]);
-		if (len >= (int)sizeof(buf)-1) fatal("stats too long");
+static int is_binary_stats(const struct stats_data *data, size_t size)
+{
+	return size == sizeof(*data)
+	       && data->magic == STATS_MAGIC
+	       && data->version == STATS_VERSION;
+}
+
+/*
+ * Read a stats file in any of the supported formats into data. Returns 0 if
+ * the file is empty or unreadable.
+ */
+static int read_stats_data(int fd, struct stats_data *data)
+{
+	union {
+		struct stats_data data;
+		char text[sizeof(struct stats_data) + 1];
+	} buf;
+	ssize_t len;
+
+	memset(data, 0, sizeof(*data));
+	data->magic = STATS_MAGIC;
+	data->version = STATS_VERSION;
+
+	len = pread(fd, &buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		return 0;
+	}
+	if (is_binary_stats(&buf.data, len)) {
+		memcpy(data, &buf.data, sizeof(*data));
+		return 1;
+	}
+	if (len == sizeof(*data)
+	    && buf.data.magic == STATS_MAGIC && buf.data.version == 2) {
+		memcpy(data->counters, buf.data.counters, sizeof(data->counters));
+		memcpy(data->latency, buf.data.latency, sizeof(data->latency));
+	} else if (len == STATS_V1_SIZE
+		   && buf.data.magic == STATS_MAGIC && buf.data.version == 1) {
+		memcpy(data->counters, buf.data.counters, sizeof(data->counters));
+	} else {
+		buf.text[len] = 0;
+		parse_stats(data->counters, buf.text);
 	}
-	len += snprintf(buf+len, sizeof(buf)-(len+1), "\n");
-	if (len >= (int)sizeof(buf)-1) fatal("stats too long");
 
-	lseek(fd, 0, SEEK_SET);
-	if (write(fd, buf, len) == -1) fatal("Could not write stats");
+	/* Older formats counted sizes in KiB. */
+	data->counters[STATS_TOTALSIZE] *= 1024;
+	data->counters[STATS_MAXSIZE] *= 1024;
+	return 1;
 }
 
-
-/* fill in some default stats values */
-static void stats_default(unsigned counters[STATS_END])
+/*
+ * Like read_stats_data(), but for reading without converting the file. A file
+ * that isn't in the current format may be in the middle of a conversion, so
+ * it's read again under a read lock, which waits for the converter.
+ */
+static int read_stats_data_unconverted(int fd, struct stats_data *data)
 {
-	counters[STATS_MAXSIZE] += DEFAULT_MAXSIZE / 16;
+	struct stats_data head;
+	ssize_t len;
+
+	len = pread(fd, &head, sizeof(head), 0);
+	if (!is_binary_stats(&head, len) && read_lock_fd(fd) != 0) {
+		return 0;
+	}
+	return read_stats_data(fd, data);
 }
 
-/* read in the stats from one dir and add to the counters */
-static void stats_read_fd(int fd, unsigned counters[STATS_END])
+/* read in the stats from an open stats file and add to the counters */
+static void stats_read_fd(int fd, uint64_t counters[STATS_END])
 {
-	char buf[1024];
-	int len;
-	len = read(fd, buf, sizeof(buf)-1);
-	if (len <= 0) {
+	struct stats_data data;
+	int i;
+
+	if (!read_stats_data_unconverted(fd, &data)) {
 		stats_default(counters);
 		return;
 	}
-	buf[len] = 0;
-	parse_stats(counters, buf);
+	for (i = 0; i < STATS_END; i++) {
+		counters[i] += data.counters[i];
+	}
 }
 
 /*
- * Update a statistics counter (unless it's STATS_NONE) and also record that a
- * number of bytes and files have been added to the cache. Size is in KiB.
+ * Make sure that an open stats file is in the current binary format,
+ * converting it under a write lock if needed. Returns 0 on success.
+ */
+static int convert_stats_fd(int fd)
+{
+	struct stats_data data;
+	ssize_t len;
+
+	len = pread(fd, &data, sizeof(data), 0);
+	if (is_binary_stats(&data, len)) {
+		return 0;
+	}
+
+	if (write_lock_fd(fd) != 0) {
+		return -1;
+	}
+	/* Somebody else may have converted the file while we waited. */
+	len = pread(fd, &data, sizeof(data), 0);
+	if (is_binary_stats(&data, len)) {
+		return 0;
+	}
+
+	if (!read_stats_data(fd, &data)) {
+		data.counters[STATS_MAXSIZE] = DEFAULT_MAXSIZE / cache_shards();
+	}
+	/*
+	 * Overwrite instead of truncating first: the file must never get
+	 * shorter than a mapping of it, or users of the mapping get SIGBUS.
+	 */
+	if (pwrite(fd, &data, sizeof(data), 0) != (ssize_t)sizeof(data)
+	    || ftruncate(fd, sizeof(data)) != 0) {
+		cc_log("Failed to convert stats file (%s)", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map a stats file into memory for updating, converting it if needed. If
+ * create is true, a missing file is created. Returns NULL on failure.
  */
-void stats_update_size(enum stats stat, size_t size, unsigned files)
+static struct stats_data *stats_map(const char *path, int create)
 {
+	struct stats_data *data;
+	struct stat st;
 	int fd;
-	unsigned counters[STATS_END];
+
+	if (create) {
+		fd = safe_open(path);
+	} else {
+		fd = open(path, O_RDWR|O_BINARY);
+	}
+	if (fd == -1) {
+		return NULL;
+	}
+	if (convert_stats_fd(fd) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*data)) {
+		cc_log("Stats file %s is too short to map", path);
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, sizeof(*data), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd); /* Releases the lock taken by the conversion, if any. */
+	if (data == MAP_FAILED) {
+		cc_log("Failed to map %s (%s)", path, strerror(errno));
+		return NULL;
+	}
+	/* An older ccache may have rewritten the file as text meanwhile. */
+	if (!is_binary_stats(data, sizeof(*data))) {
+		cc_log("Stats file %s changed format while mapping it", path);
+		munmap(data, sizeof(*data));
+		return NULL;
+	}
+	return data;
+}
+
+static void stats_unmap(struct stats_data *data)
+{
+	munmap(data, sizeof(*data));
+}
+
+/* Atomically add to a counter and return the new value. */
+static uint64_t counter_add(uint64_t *counter, uint64_t value)
+{
+#ifdef HAVE_SYNC_BUILTINS
+	return __sync_add_and_fetch(counter, value);
+#else
+	*counter += value;
+	return *counter;
+#endif
+}
+
+/* Atomically set a counter. */
+static void counter_set(uint64_t *counter, uint64_t value)
+{
+#ifdef HAVE_SYNC_BUILTINS
+	__sync_lock_test_and_set(counter, value);
+#else
+	*counter = value;
+#endif
+}
+
+/*
+ * Counter changes and phase latencies of this invocation that haven't been
+ * written to pending_file yet. They are written by stats_flush(), at exit at
+ * the latest, so that a compilation only updates a stats file once.
+ */
+static char *pending_file;
+static uint64_t pending[STATS_END];
+static uint64_t pending_latency[PHASE_END][LATENCY_BUCKETS];
+static int pending_changes;
+
+static void flush_at_exit(void)
+{
+	static int registered = 0;
+
+	if (!registered) {
+		atexit(stats_flush);
+		registered = 1;
+	}
+}
+
+/*
+ * Write the pending changes to the stats file. If a limit is exceeded, a
+ * cleanup of the subdirectory is started in the background.
+ */
+void stats_flush(void)
+{
+	struct stats_data *data;
+	uint64_t num_files, total_size;
 	int need_cleanup = 0;
+	int i, j;
+	char *dir = NULL;
+#ifndef HAVE_SYNC_BUILTINS
+	int fd;
+#endif
+
+	if (!pending_changes) goto out;
+
+	if (!pending_file) {
+		/*
+		 * Only latencies were recorded. They don't justify creating a
+		 * stats file, e.g. in read-only mode.
+		 */
+		if (stats_file) {
+			pending_file = x_strdup(stats_file);
+		} else if (cache_dir) {
+			x_asprintf(&pending_file, "%s/stats", cache_dir);
+		} else {
+			goto out;
+		}
+		data = stats_map(pending_file, 0);
+	} else {
+		data = stats_map(pending_file, 1);
+	}
+	if (!data) goto out;
+
+#ifndef HAVE_SYNC_BUILTINS
+	/* Without atomic operations, updates have to be serialized. */
+	fd = safe_open(pending_file);
+	if (fd != -1) {
+		write_lock_fd(fd);
+	}
+#endif
+
+	for (i = 0; i < STATS_END; i++) {
+		if (pending[i] != 0
+		    && i != STATS_NUMFILES && i != STATS_TOTALSIZE) {
+			counter_add(&data->counters[i], pending[i]);
+		}
+	}
+	num_files = counter_add(&data->counters[STATS_NUMFILES],
+				pending[STATS_NUMFILES]);
+	total_size = counter_add(&data->counters[STATS_TOTALSIZE],
+				 pending[STATS_TOTALSIZE]);
+	for (i = 0; i < PHASE_END; i++) {
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			if (pending_latency[i][j] != 0) {
+				counter_add(&data->latency[i][j],
+					    pending_latency[i][j]);
+			}
+		}
+	}
+
+	if (data->counters[STATS_MAXFILES] != 0 &&
+	    num_files > data->counters[STATS_MAXFILES]) {
+		need_cleanup = 1;
+	}
+	if (data->counters[STATS_MAXSIZE] != 0 &&
+	    total_size > data->counters[STATS_MAXSIZE]) {
+		need_cleanup = 1;
+	}
+	stats_unmap(data);
+#ifndef HAVE_SYNC_BUILTINS
+	if (fd != -1) {
+		close(fd);
+	}
+#endif
+
+	if (need_cleanup) {
+		dir = dirname(pending_file);
+	}
+
+out:
+	memset(pending, 0, sizeof(pending));
+	memset(pending_latency, 0, sizeof(pending_latency));
+	pending_changes = 0;
+	free(pending_file);
+	pending_file = NULL;
 
+	/* The cleaner must not inherit the changes written above. */
+	if (dir) {
+		cleanup_dir_in_background(dir);
+		free(dir);
+	}
+}
+
+/*
+ * Update a statistics counter (unless it's STATS_NONE) and also record that a
+ * number of bytes and files have been added to the cache. A negative size
+ * records that the cache shrank. The change is written by stats_flush().
+ */
+void stats_update_size(enum stats stat, int64_t size, unsigned files)
+{
 	if (getenv("CCACHE_NOSTATS")) return;
 
 	if (!stats_file) {
@@ -162,35 +670,79 @@ void stats_update_size(enum stats stat, size_t size, unsigned files)
 		x_asprintf(&stats_file, "%s/stats", cache_dir);
 	}
 
-	fd = safe_open(stats_file);
-	if (fd == -1) return;
-	if (write_lock_fd(fd) != 0) return;
-
-	memset(counters, 0, sizeof(counters));
-	stats_read_fd(fd, counters);
+	if (pending_file && strcmp(pending_file, stats_file) != 0) {
+		stats_flush();
+	}
+	if (!pending_file) {
+		pending_file = x_strdup(stats_file);
+	}
+	flush_at_exit();
 
 	if (stat != STATS_NONE) {
-		counters[stat]++;
+		pending[stat]++;
 	}
-	counters[STATS_NUMFILES] += files;
-	counters[STATS_TOTALSIZE] += size;
+	pending[STATS_NUMFILES] += files;
+	/* Wraps around for negative sizes, as the counter does when adding. */
+	pending[STATS_TOTALSIZE] += (uint64_t)size;
+	pending_changes = 1;
+}
 
-	write_stats(fd, counters);
-	close(fd);
+/* Return the current time in microseconds, for measuring phase latencies. */
+uint64_t stats_timer(void)
+{
+	struct timeval tv;
 
-	if (counters[STATS_MAXFILES] != 0 &&
-	    counters[STATS_NUMFILES] > counters[STATS_MAXFILES]) {
-		need_cleanup = 1;
-	}
-	if (counters[STATS_MAXSIZE] != 0 &&
-	    counters[STATS_TOTALSIZE] > counters[STATS_MAXSIZE]) {
-		need_cleanup = 1;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Return the histogram bucket of a duration in microseconds. */
+static int latency_bucket(uint64_t usec)
+{
+	int i = 0;
+
+	usec++;
+	while (usec > 1 && i < LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		i++;
 	}
+	return i;
+}
 
-	if (need_cleanup) {
-		char *p = dirname(stats_file);
-		cleanup_dir(p, counters[STATS_MAXFILES], counters[STATS_MAXSIZE]);
-		free(p);
+/*
+ * Record that a phase which started at start (as returned by stats_timer())
+ * has ended. The latency is written by stats_flush() to the stats file the
+ * other changes go to.
+ */
+void stats_latency(enum stats_phase phase, uint64_t start)
+{
+	uint64_t now;
+
+	if (getenv("CCACHE_NOSTATS")) return;
+
+	now = stats_timer();
+	pending_latency[phase][latency_bucket(now > start ? now - start : 0)]++;
+	pending_changes = 1;
+	flush_at_exit();
+}
+
+/*
+ * Add a phase latency in microseconds directly to the stats file of a cache
+ * subdirectory.
+ */
+void stats_add_latency(const char *dir, enum stats_phase phase, uint64_t usec)
+{
+	struct stats_data *data;
+	char *path;
+
+	if (getenv("CCACHE_NOSTATS")) return;
+
+	x_asprintf(&path, "%s/stats", dir);
+	data = stats_map(path, 1);
+	free(path);
+	if (data) {
+		counter_add(&data->latency[phase][latency_bucket(usec)], 1);
+		stats_unmap(data);
 	}
 }
 
@@ -200,8 +752,11 @@ void stats_update(enum stats stat)
 	stats_update_size(stat, 0, 0);
 }
 
-/* read in the stats from one dir and add to the counters */
-void stats_read(const char *stats_file, unsigned counters[STATS_END])
+/*
+ * read in the stats from one dir and add to the counters. The file is only
+ * read; conversion is left to the update paths.
+ */
+void stats_read(const char *stats_file, uint64_t counters[STATS_END])
 {
 	int fd;
 
@@ -210,7 +765,6 @@ void stats_read(const char *stats_file, unsigned counters[STATS_END])
 		stats_default(counters);
 		return;
 	}
-	read_lock_fd(fd);
 	stats_read_fd(fd, counters);
 	close(fd);
 }
@@ -219,18 +773,19 @@ void stats_read(const char *stats_file, unsigned counters[STATS_END])
 void stats_summary(void)
 {
 	int dir, i;
-	unsigned counters[STATS_END];
+	uint64_t counters[STATS_END];
 
 	memset(counters, 0, sizeof(counters));
 
 	/* add up the stats in each directory */
-	for (dir=-1;dir<=0xF;dir++) {
+	for (dir=-1;dir<cache_shards();dir++) {
 		char *fname;
 
 		if (dir == -1) {
 			x_asprintf(&fname, "%s/stats", cache_dir);
 		} else {
-			x_asprintf(&fname, "%s/%1x/stats", cache_dir, dir);
+			x_asprintf(&fname, "%s/%0*x/stats", cache_dir,
+				   shard_width(), dir);
 		}
 
 		stats_read(fname, counters);
@@ -259,87 +814,310 @@ void stats_summary(void)
 			stats_info[i].fn(counters[stat]);
 			printf("\n");
 		} else {
-			printf("%8u\n", counters[stat]);
+			printf("%8llu\n", (unsigned long long)counters[stat]);
 		}
 	}
 }
 
+/* format a latency in microseconds for display - caller frees */
+static char *format_latency(uint64_t usec)
+{
+	char *s;
+
+	if (usec < 1000) {
+		x_asprintf(&s, "%u us", (unsigned)usec);
+	} else if (usec < 1000000) {
+		x_asprintf(&s, "%.1f ms", usec / 1000.0);
+	} else {
+		x_asprintf(&s, "%.2f s", usec / 1000000.0);
+	}
+	return s;
+}
+
+/*
+ * Return an upper bound of the given percentile of the durations in a
+ * latency histogram.
+ */
+static uint64_t latency_percentile(uint64_t histogram[LATENCY_BUCKETS],
+				   uint64_t count, unsigned percentile)
+{
+	uint64_t target = (count * percentile + 99) / 100;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += histogram[i];
+		if (seen >= target) {
+			break;
+		}
+	}
+	return ((uint64_t)2 << i) - 2;
+}
+
+/*
+ * Sum the counters and latency histograms of all stats files in one pass. A
+ * missing or empty subdirectory stats file counts with the default limits.
+ */
+static void stats_collect(struct stats_data *total)
+{
+	struct stats_data data;
+	int dir, fd, i, j;
+	char *fname;
+
+	memset(total, 0, sizeof(*total));
+	for (dir=-1;dir<cache_shards();dir++) {
+		if (dir == -1) {
+			x_asprintf(&fname, "%s/stats", cache_dir);
+		} else {
+			x_asprintf(&fname, "%s/%0*x/stats", cache_dir,
+				   shard_width(), dir);
+		}
+		fd = open(fname, O_RDONLY|O_BINARY);
+		free(fname);
+		if (fd == -1 || !read_stats_data_unconverted(fd, &data)) {
+			if (dir != -1) {
+				total->counters[STATS_MAXSIZE] +=
+					DEFAULT_MAXSIZE / cache_shards();
+			}
+			if (fd != -1) {
+				close(fd);
+			}
+			continue;
+		}
+		close(fd);
+
+		for (i = 0; i < STATS_END; i++) {
+			/* the top level limits are not used */
+			if (dir == -1 && i == STATS_MAXSIZE) {
+				continue;
+			}
+			total->counters[i] += data.counters[i];
+		}
+		for (i = 0; i < PHASE_END; i++) {
+			for (j = 0; j < LATENCY_BUCKETS; j++) {
+				total->latency[i][j] += data.latency[i][j];
+			}
+		}
+	}
+}
+
+/* sum and display the phase latencies for all cache dirs */
+void stats_latency_summary(void)
+{
+	static const unsigned percentiles[] = { 50, 90, 99 };
+	struct stats_data total;
+	uint64_t (*latency)[LATENCY_BUCKETS] = total.latency;
+	uint64_t count;
+	int i, j;
+	char *s;
+
+	stats_collect(&total);
+
+	printf("phase                   count        p50        p90        p99\n");
+	for (i = 0; i < PHASE_END; i++) {
+		count = 0;
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			count += latency[i][j];
+		}
+		printf("%-16s %12llu", phase_names[i], (unsigned long long)count);
+		for (j = 0; j < 3; j++) {
+			if (count == 0) {
+				printf(" %10s", "-");
+				continue;
+			}
+			s = format_latency(
+				latency_percentile(latency[i], count,
+						   percentiles[j]));
+			printf(" %10s", s);
+			free(s);
+		}
+		printf("\n");
+	}
+}
+
+/* print a string as a JSON string literal */
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			printf("\\u%04x", (unsigned char)*s);
+		} else {
+			putchar(*s);
+		}
+	}
+	putchar('"');
+}
+
+static void print_stats_json(const struct stats_data *total)
+{
+	int i, j;
+
+	printf("{\n  \"cache_directory\": ");
+	print_json_string(cache_dir);
+	printf(",\n  \"counters\": {");
+	for (i = 0; stats_info[i].name; i++) {
+		printf("%s\n    \"%s\": %llu", i ? "," : "", stats_info[i].name,
+		       (unsigned long long)total->counters[stats_info[i].stat]);
+	}
+	printf("\n  },\n  \"latency_bucket_upper_bounds_us\": [");
+	for (j = 0; j < LATENCY_BUCKETS - 1; j++) {
+		printf("%s%llu", j ? ", " : "",
+		       (unsigned long long)(((uint64_t)2 << j) - 2));
+	}
+	printf("],\n  \"latency\": {");
+	for (i = 0; i < PHASE_END; i++) {
+		printf("%s\n    \"%s\": [", i ? "," : "", phase_ids[i]);
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			printf("%s%llu", j ? ", " : "",
+			       (unsigned long long)total->latency[i][j]);
+		}
+		printf("]");
+	}
+	printf("\n  }\n}\n");
+}
+
+static void print_stats_prometheus(const struct stats_data *total)
+{
+	const char *metric = "ccache_phase_latency_seconds";
+	uint64_t count;
+	int i, j;
+
+	for (i = 0; stats_info[i].name; i++) {
+		if (stats_info[i].flags & FLAG_NOZERO) {
+			printf("# TYPE ccache_%s gauge\n", stats_info[i].name);
+			printf("ccache_%s", stats_info[i].name);
+		} else {
+			printf("# TYPE ccache_%s_total counter\n",
+			       stats_info[i].name);
+			printf("ccache_%s_total", stats_info[i].name);
+		}
+		printf(" %llu\n", (unsigned long long)total->counters[stats_info[i].stat]);
+	}
+
+	/* bucket counts are cumulative; there is no _sum since only the
+	   bucket of each duration is recorded */
+	printf("# TYPE %s histogram\n", metric);
+	for (i = 0; i < PHASE_END; i++) {
+		count = 0;
+		for (j = 0; j < LATENCY_BUCKETS - 1; j++) {
+			count += total->latency[i][j];
+			printf("%s_bucket{phase=\"%s\",le=\"%.6f\"} %llu\n",
+			       metric, phase_ids[i],
+			       ((((uint64_t)2 << j) - 2)) / 1000000.0,
+			       (unsigned long long)count);
+		}
+		count += total->latency[i][j];
+		printf("%s_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+		       metric, phase_ids[i], (unsigned long long)count);
+		printf("%s_count{phase=\"%s\"} %llu\n",
+		       metric, phase_ids[i], (unsigned long long)count);
+	}
+}
+
+/*
+ * Print the raw counters and latency histograms of all cache dirs in a
+ * machine-readable format ("json" or "prometheus"). Returns 0 if the format
+ * is unknown.
+ */
+int stats_print(const char *format)
+{
+	struct stats_data total;
+
+	if (strcmp(format, "json") == 0) {
+		stats_collect(&total);
+		print_stats_json(&total);
+	} else if (strcmp(format, "prometheus") == 0) {
+		stats_collect(&total);
+		print_stats_prometheus(&total);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
 /* zero all the stats structures */
 void stats_zero(void)
 {
-	int dir, fd;
-	unsigned i;
+	int dir;
+	unsigned i, j;
 	char *fname;
-	unsigned counters[STATS_END];
+	struct stats_data *data;
 
+	create_cache_header();
 	x_asprintf(&fname, "%s/stats", cache_dir);
 	unlink(fname);
 	free(fname);
 
-	for (dir=0;dir<=0xF;dir++) {
-		x_asprintf(&fname, "%s/%1x/stats", cache_dir, dir);
-		fd = safe_open(fname);
-		if (fd == -1) {
-			free(fname);
+	for (dir=0;dir<cache_shards();dir++) {
+		x_asprintf(&fname, "%s/%0*x/stats", cache_dir, shard_width(),
+			   dir);
+		data = stats_map(fname, 1);
+		free(fname);
+		if (!data) {
 			continue;
 		}
-		memset(counters, 0, sizeof(counters));
-		write_lock_fd(fd);
-		stats_read_fd(fd, counters);
 		for (i=0;stats_info[i].message;i++) {
 			if (!(stats_info[i].flags & FLAG_NOZERO)) {
-				counters[stats_info[i].stat] = 0;
+				counter_set(&data->counters[stats_info[i].stat], 0);
 			}
 		}
-		write_stats(fd, counters);
-		close(fd);
-		free(fname);
+		for (i=0;i<PHASE_SLOTS;i++) {
+			for (j=0;j<LATENCY_BUCKETS;j++) {
+				counter_set(&data->latency[i][j], 0);
+			}
+		}
+		stats_unmap(data);
 	}
 }
 
 
-/* set the per directory limits */
-int stats_set_limits(long maxfiles, long maxsize)
+/*
+ * Share a limit out among the shards so that the shares add up to the limit
+ * exactly.
+ */
+static uint64_t limit_share(int64_t limit, int dir)
 {
-	int dir;
-	unsigned counters[STATS_END];
+	int shards = cache_shards();
 
-	if (maxfiles != -1) {
-		maxfiles /= 16;
-	}
-	if (maxsize != -1) {
-		maxsize /= 16;
-	}
+	return limit / shards + (dir < limit % shards ? 1 : 0);
+}
+
+/* set the per directory limits; -1 leaves a limit unchanged */
+int stats_set_limits(int64_t maxfiles, int64_t maxsize)
+{
+	int dir;
+	struct stats_data *data;
 
 	if (create_dir(cache_dir) != 0) {
 		return 1;
 	}
+	create_cache_header();
 
 	/* set the limits in each directory */
-	for (dir=0;dir<=0xF;dir++) {
+	for (dir=0;dir<cache_shards();dir++) {
 		char *fname, *cdir;
-		int fd;
 
-		x_asprintf(&cdir, "%s/%1x", cache_dir, dir);
+		cdir = shard_dir(cache_dir, dir);
 		if (create_dir(cdir) != 0) {
 			return 1;
 		}
 		x_asprintf(&fname, "%s/stats", cdir);
 		free(cdir);
 
-		memset(counters, 0, sizeof(counters));
-		fd = safe_open(fname);
-		if (fd != -1) {
-			write_lock_fd(fd);
-			stats_read_fd(fd, counters);
+		data = stats_map(fname, 1);
+		if (data) {
 			if (maxfiles != -1) {
-				counters[STATS_MAXFILES] = maxfiles;
+				counter_set(&data->counters[STATS_MAXFILES],
+					    limit_share(maxfiles, dir));
 			}
 			if (maxsize != -1) {
-				counters[STATS_MAXSIZE] = maxsize;
+				counter_set(&data->counters[STATS_MAXSIZE],
+					    limit_share(maxsize, dir));
 			}
-			write_stats(fd, counters);
-			close(fd);
+			stats_unmap(data);
 		}
 		free(fname);
 	}
@@ -348,25 +1126,19 @@ int stats_set_limits(long maxfiles, long maxsize)
 }
 
 /* set the per directory sizes */
-void stats_set_sizes(const char *dir, size_t num_files, size_t total_size)
+void stats_set_sizes(const char *dir, uint64_t num_files, uint64_t total_size)
 {
-	int fd;
-	unsigned counters[STATS_END];
+	struct stats_data *data;
 	char *stats_file;
 
 	create_dir(dir);
 	x_asprintf(&stats_file, "%s/stats", dir);
 
-	memset(counters, 0, sizeof(counters));
-
-	fd = safe_open(stats_file);
-	if (fd != -1) {
-		write_lock_fd(fd);
-		stats_read_fd(fd, counters);
-		counters[STATS_NUMFILES] = num_files;
-		counters[STATS_TOTALSIZE] = total_size;
-		write_stats(fd, counters);
-		close(fd);
+	data = stats_map(stats_file, 1);
+	if (data) {
+		counter_set(&data->counters[STATS_NUMFILES], num_files);
+		counter_set(&data->counters[STATS_TOTALSIZE], total_size);
+		stats_unmap(data);
 	}
 
 	free(stats_file);
@@ -30,6 +30,7 @@ unset CCACHE_EXTENSION
 unset CCACHE_EXTRAFILES
 unset CCACHE_HARDLINK
 unset CCACHE_HASHDIR
+unset CCACHE_LEASETIMEOUT
 unset CCACHE_LOGFILE
 unset CCACHE_NLEVELS
 unset CCACHE_NODIRECT
@@ -80,6 +81,19 @@ checkstat() {
     fi
 }
 
+# Wait (at most ten seconds) for a statistics counter to reach a value, e.g.
+# when a cleanup is running in the background.
+waitstat() {
+    stat="$1"
+    expected_value="$2"
+    i=0
+    while [ $i -lt 100 ] && [ "`getstat "$stat"`" != "$expected_value" ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    checkstat "$stat" "$expected_value"
+}
+
 checkfile() {
     if [ ! -f $1 ]; then
         test_failed "$1 not found"
@@ -93,7 +107,8 @@ checkfilecount() {
     expected=$1
     pattern=$2
     dir=$3
-    actual=`find $dir -name "$pattern" | wc -l`
+    # Trees that are being deleted after ccache -C don't count.
+    actual=`find $dir -name "$pattern" ! -path '*.wipe.*' | wc -l`
     if [ $actual -ne $expected ]; then
         test_failed "Found $actual (expected $expected) $pattern files in $dir"
     fi
@@ -361,9 +376,32 @@ EOF
     CCACHE_PREFIX=`pwd`/prefix-empty.sh $CCACHE_COMPILE -c test_empty_obj.c
     checkstat 'compiler produced empty output' 1
 
+    testname="response file"
+    $CCACHE -z >/dev/null
+    echo 'char *at = S;' >at.c
+    cat <<'EOF' >at.rsp
+-c at.c
+"-DS=\"a b\"" -o 'at 1.o'
+EOF
+    echo '@at.rsp' >at2.rsp
+    $CCACHE_COMPILE @at.rsp
+    checkstat 'cache miss' 1
+    if [ ! -f "at 1.o" ]; then
+        test_failed "Object file not created"
+    fi
+    rm -f "at 1.o"
+    $CCACHE_COMPILE @at2.rsp
+    checkstat 'cache hit (preprocessed)' 1
+    if [ ! -f "at 1.o" ]; then
+        test_failed "Object file not created"
+    fi
+    $CCACHE_COMPILE @missing.rsp 2>/dev/null
+    checkstat 'bad compiler arguments' 1
+    rm -f at.c at.rsp at2.rsp "at 1.o"
+
     testname="stderr-files"
     $CCACHE -Cz >/dev/null
-    num=`find $CCACHE_DIR -name '*.stderr' | wc -l`
+    num=`find $CCACHE_DIR -name '*.stderr' ! -path '*.wipe.*' | wc -l`
     if [ $num -ne 0 ]; then
         test_failed "$num stderr files found, expected 0"
     fi
@@ -375,17 +413,42 @@ int stderr(void)
 EOF
     checkstat 'files in cache' 0
     $CCACHE_COMPILE -Wall -W -c stderr.c 2>/dev/null
-    num=`find $CCACHE_DIR -name '*.stderr' | wc -l`
+    num=`find $CCACHE_DIR -name '*.stderr' ! -path '*.wipe.*' | wc -l`
     if [ $num -ne 1 ]; then
         test_failed "$num stderr files found, expected 1"
     fi
     checkstat 'files in cache' 2
 
+    testname="show-latency"
+    compiles=`$CCACHE --show-latency | grep '^compiler ' | awk '{print $2}'`
+    if [ -z "$compiles" ] || [ $compiles -eq 0 ]; then
+        test_failed "No compiler latencies recorded"
+    fi
+
+    testname="print-stats"
+    misses=`getstat 'cache miss'`
+    if ! $CCACHE --print-stats | grep "\"cache_miss\": $misses,\$" >/dev/null; then
+        test_failed "Cache misses not in JSON output"
+    fi
+    if ! $CCACHE --print-stats --format=prometheus | grep "^ccache_cache_miss_total $misses\$" >/dev/null; then
+        test_failed "Cache misses not in Prometheus output"
+    fi
+    if ! $CCACHE --print-stats --format=prometheus | grep '^ccache_phase_latency_seconds_count{phase="compiler"} [1-9]' >/dev/null; then
+        test_failed "Compiler latencies not in Prometheus output"
+    fi
+    if $CCACHE --print-stats --format=xml >/dev/null 2>&1; then
+        test_failed "Unknown format accepted"
+    fi
+
     testname="zero-stats"
     $CCACHE -z > /dev/null
     checkstat 'cache hit (preprocessed)' 0
     checkstat 'cache miss' 0
     checkstat 'files in cache' 2
+    compiles=`$CCACHE --show-latency | grep '^compiler ' | awk '{print $2}'`
+    if [ "$compiles" != 0 ]; then
+        test_failed "Latencies not zeroed"
+    fi
 
     testname="clear"
     $CCACHE -C > /dev/null
@@ -455,6 +518,238 @@ nlevels1_suite() {
     unset CCACHE_NLEVELS
 }
 
+shards256_suite() {
+    CCACHE_COMPILE="$CCACHE $COMPILER"
+    CCACHE_SHARDS=256
+    export CCACHE_SHARDS
+    base_tests
+
+    testname="shard layout"
+    if [ "`cat $CCACHE_DIR/header`" != "shards 256" ]; then
+        test_failed "Shard count not recorded in the cache header"
+    fi
+    echo 'int x;' >test1.c
+    $CCACHE_COMPILE -c test1.c
+    if [ `find $CCACHE_DIR/?? -name '*.o' | wc -l` -ne 1 ]; then
+        test_failed "Result not stored in a two-digit shard"
+    fi
+    $CCACHE -F 1000 >/dev/null
+    if [ "`cat $CCACHE_DIR/??/stats | wc -c`" -ne `expr 256 \* 4616` ]; then
+        test_failed "Limits not set in all shards"
+    fi
+    checkstat 'max files' 1000
+
+    testname="header wins"
+    CCACHE_SHARDS=16 $CCACHE_COMPILE -c test1.c
+    checkstat 'cache hit (preprocessed)' 1
+
+    testname="read-only header"
+    CCACHE_DIR=`pwd`/fresh $CCACHE -s >/dev/null
+    if [ -e fresh ]; then
+        test_failed "Cache directory created by ccache -s"
+    fi
+
+    testname="legacy layout"
+    mkdir -p legacy/5
+    CCACHE_DIR=`pwd`/legacy $CCACHE -F 16 >/dev/null
+    if [ "`cat legacy/header`" != "shards 16" ]; then
+        test_failed "Cache without header not taken as legacy layout"
+    fi
+    rm -rf legacy
+
+    rm -f test1.c
+    unset CCACHE_SHARDS
+}
+
+server_suite() {
+    CCACHE_COMPILE="$CCACHE $COMPILER"
+    CCACHE_SERVER=`pwd`/server.sock
+    export CCACHE_SERVER
+    $CCACHE --server &
+    server_pid=$!
+    i=0
+    while [ $i -lt 100 ] && [ ! -S $CCACHE_SERVER ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+
+    testname="compile in server"
+    echo 'int x;' >test1.c
+    CCACHE_LOGFILE=`pwd`/server.log $CCACHE_COMPILE -c test1.c
+    checkstat 'cache miss' 1
+    if [ ! -f test1.o ]; then
+        test_failed "test1.o not created"
+    fi
+    if ! grep "Running in the ccache server" server.log >/dev/null; then
+        test_failed "Compilation not run by the server"
+    fi
+    $CCACHE_COMPILE -c test1.c
+    checkstat 'cache hit (preprocessed)' 1
+
+    testname="exit status from server"
+    echo 'bad' >bad.c
+    if $CCACHE_COMPILE -c bad.c 2>bad.err; then
+        test_failed "Failed compilation reported as successful"
+    fi
+    if ! grep error bad.err >/dev/null; then
+        test_failed "Compiler errors not passed to the client"
+    fi
+
+    testname="changed include file in server"
+    unset CCACHE_NODIRECT
+    mkdir -p include
+    echo 'int a;' >include/test2.h
+    backdate include/test2.h
+    echo "#include \"`pwd`/include/test2.h\"" >test2.c
+    # Let the status change time of the include file get old enough.
+    sleep 1
+    $CCACHE_COMPILE -c test2.c
+    checkstat 'cache miss' 2
+    $CCACHE_COMPILE -c test2.c
+    checkstat 'cache hit (direct)' 1
+    echo 'int b;' >include/test2.h
+    backdate include/test2.h
+    $CCACHE_COMPILE -c test2.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 3
+    CCACHE_NODIRECT=1
+    export CCACHE_NODIRECT
+
+    testname="no server"
+    kill $server_pid
+    wait $server_pid
+    if [ -S $CCACHE_SERVER ]; then
+        test_failed "Socket not removed"
+    fi
+    $CCACHE_COMPILE -c test1.c
+    checkstat 'cache hit (preprocessed)' 2
+
+    rm -rf test1.c test1.o test2.c test2.o bad.c bad.err server.log include
+    unset CCACHE_SERVER
+}
+
+batch_suite() {
+    testname="batch"
+    mkdir -p batchdir
+    echo 'int a;' >batchdir/a.c
+    echo 'char *b = NAME;' >b.c
+    compiler_args=""
+    for word in $COMPILER; do
+        compiler_args="$compiler_args\"$word\", "
+    done
+    cat <<EOF >compile_commands.json
+[
+  {
+    "directory": "`pwd`/batchdir",
+    "command": "$COMPILER -c a.c -o 'a 1.o'",
+    "file": "a.c"
+  },
+  {
+    "directory": "`pwd`",
+    "arguments": [$compiler_args"-DNAME=\"b c\"", "-c", "b.c"],
+    "file": "b.c",
+    "output": "b.o"
+  }
+]
+EOF
+    $CCACHE --batch compile_commands.json -j2
+    checkstat 'cache miss' 2
+    if [ ! -f "batchdir/a 1.o" ] || [ ! -f b.o ]; then
+        test_failed "Object files not created"
+    fi
+    rm -f "batchdir/a 1.o" b.o
+    $CCACHE --batch compile_commands.json
+    checkstat 'cache hit (preprocessed)' 2
+    if [ ! -f "batchdir/a 1.o" ] || [ ! -f b.o ]; then
+        test_failed "Object files not created"
+    fi
+
+    testname="batch failure"
+    echo 'bad' >bad.c
+    cat <<EOF >compile_commands.json
+[{"directory": "`pwd`", "command": "$COMPILER -c bad.c", "file": "bad.c"}]
+EOF
+    if $CCACHE --batch compile_commands.json 2>bad.err; then
+        test_failed "Failed compilation reported as successful"
+    fi
+    if ! grep "compilation of bad.c failed" bad.err >/dev/null; then
+        test_failed "Failed compilation not reported"
+    fi
+
+    testname="batch invalid"
+    echo '[{"directory": "."}' >compile_commands.json
+    if $CCACHE --batch compile_commands.json 2>/dev/null; then
+        test_failed "Invalid compilation database accepted"
+    fi
+    for s in '\uD800A' '\uD800' '\uD800x' '\uDC00'; do
+        cat <<EOF >compile_commands.json
+[{"directory": ".", "command": "$COMPILER -c -DX=$s bad.c", "file": "bad.c"}]
+EOF
+        if $CCACHE --batch compile_commands.json 2>bad.err; then
+            test_failed "Unpaired surrogate $s accepted"
+        fi
+        if ! grep "invalid surrogate pair" bad.err >/dev/null; then
+            test_failed "Unpaired surrogate $s not reported"
+        fi
+    done
+
+    testname="prefetch"
+    unset CCACHE_NODIRECT
+    echo 'int p;' >prefetch.c
+    cat <<EOF >compile_commands.json
+[{"directory": "`pwd`", "command": "$COMPILER -c prefetch.c", "file": "prefetch.c"}]
+EOF
+    $CCACHE --prefetch compile_commands.json >prefetch.out
+    if [ "`cat prefetch.out`" != "miss `pwd`/prefetch.c" ]; then
+        test_failed "Expected miss, got `cat prefetch.out`"
+    fi
+    checkstat 'cache miss' 2
+    $CCACHE $COMPILER -c prefetch.c
+    checkstat 'cache miss' 3
+    $CCACHE --prefetch compile_commands.json >prefetch.out
+    if [ "`cat prefetch.out`" != "hit `pwd`/prefetch.c" ]; then
+        test_failed "Expected hit, got `cat prefetch.out`"
+    fi
+    checkstat 'cache hit (direct)' 0
+    CCACHE_NODIRECT=1
+    export CCACHE_NODIRECT
+
+    rm -rf batchdir b.c b.o bad.c bad.err compile_commands.json prefetch.c \
+        prefetch.o prefetch.out
+}
+
+lease_suite() {
+    cat <<EOF >slowcc
+#!/bin/sh
+# Compile slowly so that the compilations overlap.
+case " \$* " in
+    *" -E "*) ;;
+    *) sleep 1 ;;
+esac
+exec $COMPILER "\$@"
+EOF
+    chmod +x slowcc
+    echo 'int lease;' >lease.c
+    CCACHE_LEASETIMEOUT=60
+    export CCACHE_LEASETIMEOUT
+
+    testname="coalesced compilation"
+    $CCACHE ./slowcc -c lease.c -o lease1.o &
+    $CCACHE ./slowcc -c lease.c -o lease2.o
+    wait
+    checkstat 'cache miss' 1
+    checkstat 'cache hit (preprocessed)' 1
+    if [ ! -f lease1.o ] || [ ! -f lease2.o ]; then
+        test_failed "Object files not created"
+    fi
+    if [ -n "`find $CCACHE_DIR -name '*.lease'`" ]; then
+        test_failed "Lease not released"
+    fi
+
+    unset CCACHE_LEASETIMEOUT
+    rm -f slowcc lease.c lease1.o lease2.o
+}
+
 direct_suite() {
     unset CCACHE_NODIRECT
 
@@ -550,6 +845,125 @@ EOF
 
     rm -f other.d
 
+    ##################################################################
+    # Test the preprocessor started during the direct lookup.
+    testname="early preprocessor"
+    $CCACHE -z >/dev/null
+    echo "int test2_2;" >>test2.h
+    backdate test2.h
+    CCACHE_EARLYCPP=1 CCACHE_LOGFILE=`pwd`/early.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache hit (preprocessed)' 0
+    checkstat 'cache miss' 1
+    if ! grep "Waiting for the early preprocessor" early.log >/dev/null; then
+        test_failed "Early preprocessor not used"
+    fi
+    mv test.o test.o.ref
+
+    rm -f early.log
+    CCACHE_EARLYCPP=1 CCACHE_LOGFILE=`pwd`/early.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache hit (preprocessed)' 0
+    checkstat 'cache miss' 1
+    if ! grep "Stopped the early preprocessor" early.log >/dev/null; then
+        test_failed "Early preprocessor not stopped"
+    fi
+    cmp test.o test.o.ref >/dev/null || test_failed "Wrong object file"
+    rm -f early.log test.o.ref
+
+    ##################################################################
+    # Test compilation started before a lookup that is likely to miss.
+    testname="speculative compilation"
+    $CCACHE -z >/dev/null
+    echo "int test2_3;" >>test2.h
+    backdate test2.h
+    CCACHE_SPECULATE=1 CCACHE_LOGFILE=`pwd`/spec.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache miss' 1
+    if grep "Started the compiler speculatively" spec.log >/dev/null; then
+        test_failed "Speculative compilation without a previous miss"
+    fi
+
+    rm -f spec.log
+    echo "int test2_4;" >>test2.h
+    backdate test2.h
+    CCACHE_SPECULATE=1 CCACHE_LOGFILE=`pwd`/spec.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache miss' 2
+    if ! grep "Waiting for the compiler started early" spec.log >/dev/null; then
+        test_failed "Speculative compilation not used"
+    fi
+    $COMPILER -c test.c -o reference_test.o
+    cmp test.o reference_test.o >/dev/null || test_failed "Wrong object file"
+
+    rm -f spec.log
+    CCACHE_SPECULATE=1 CCACHE_LOGFILE=`pwd`/spec.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 2
+    if ! grep "Stopped the compiler started early" spec.log >/dev/null; then
+        test_failed "Speculative compilation not stopped"
+    fi
+    cmp test.o reference_test.o >/dev/null || test_failed "Wrong object file"
+
+    rm -f spec.log
+    CCACHE_SPECULATE=1 CCACHE_LOGFILE=`pwd`/spec.log $CCACHE $COMPILER -c test.c
+    checkstat 'cache hit (direct)' 2
+    if grep "Started the compiler speculatively" spec.log >/dev/null; then
+        test_failed "Speculative compilation after a hit"
+    fi
+    rm -f spec.log reference_test.o
+
+    testname="miss markers"
+    $CCACHE -Cz >/dev/null
+    echo "int test2_5;" >>test2.h
+    backdate test2.h
+    CCACHE_SPECULATE=1 $CCACHE $COMPILER -c test.c
+    echo "int test2_6;" >>test2.h
+    backdate test2.h
+    CCACHE_SPECULATE=1 $CCACHE $COMPILER -c test.c
+    checkstat 'cache miss' 2
+    checkfilecount 1 '*.miss' $CCACHE_DIR
+    $CCACHE -c >/dev/null
+    checkfilecount 1 '*.miss' $CCACHE_DIR
+    results=`find $CCACHE_DIR -type f \( -name '*.o' -o -name '*.stderr' \
+        -o -name '*.d' -o -name '*.manifest' \) | wc -l`
+    checkstat 'files in cache' $results
+
+    ##################################################################
+    # Test depend mode, which takes the included files from the
+    # dependency file instead of running the preprocessor.
+    testname="depend mode"
+    $CCACHE -Cz >/dev/null
+    CCACHE_DEPEND=1 CCACHE_LOGFILE=`pwd`/depend.log $CCACHE $COMPILER -MD -c test.c
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache hit (preprocessed)' 0
+    checkstat 'cache miss' 1
+    if ! grep "Running real compiler in depend mode" depend.log >/dev/null; then
+        test_failed "Depend mode not used"
+    fi
+    if grep "Running preprocessor" depend.log >/dev/null; then
+        test_failed "Preprocessor run in depend mode"
+    fi
+    $COMPILER -MD -c test.c -o reference_test.o -MF reference_test.d -MT test.o
+    cmp test.d reference_test.d >/dev/null || test_failed "Wrong dependency file"
+
+    rm -f test.o test.d
+    CCACHE_DEPEND=1 $CCACHE $COMPILER -MD -c test.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 1
+    cmp test.o reference_test.o >/dev/null || test_failed "Wrong object file"
+    cmp test.d reference_test.d >/dev/null || test_failed "Wrong dependency file"
+
+    echo "int test3_3;" >>test3.h
+    backdate test3.h
+    CCACHE_DEPEND=1 $CCACHE $COMPILER -MD -c test.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 2
+    CCACHE_DEPEND=1 $CCACHE $COMPILER -MD -c test.c
+    checkstat 'cache hit (direct)' 2
+    checkstat 'cache miss' 2
+
+    rm -f depend.log test.d reference_test.o reference_test.d
+
     ##################################################################
     # Check calculation of dependency file names.
     $CCACHE -Cz >/dev/null
@@ -1083,6 +1497,82 @@ EOF
     $CCACHE -C >/dev/null
 }
 
+pch_suite() {
+    unset CCACHE_NODIRECT
+
+    cat <<EOF >pch.h
+int pch;
+#define VALUE 1
+EOF
+    cat <<EOF >pch.c
+int test(void) { return VALUE; }
+EOF
+    backdate pch.h pch.c
+    if ! $COMPILER -c pch.h -o pch.h.gch 2>/dev/null; then
+        echo "Compiler doesn't support precompiled headers; skipping"
+        rm -f pch.h pch.c pch.h.gch
+        CCACHE_NODIRECT=1
+        export CCACHE_NODIRECT
+        return
+    fi
+    mv pch.h.gch reference_pch.h.gch
+
+    ##################################################################
+    # Creating a precompiled header.
+    testname="create pch"
+    $CCACHE -z >/dev/null
+    $CCACHE $COMPILER -c pch.h
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache miss' 1
+    if [ ! -f pch.h.gch ]; then
+        test_failed "Precompiled header not created"
+    fi
+    cp pch.h.gch first_pch.h.gch
+    rm pch.h.gch
+    $CCACHE $COMPILER -c pch.h
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 1
+    cmp pch.h.gch first_pch.h.gch >/dev/null || test_failed "Wrong precompiled header"
+    backdate pch.h.gch
+
+    ##################################################################
+    # Using a precompiled header with -include.
+    testname="use pch"
+    $CCACHE -z >/dev/null
+    $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache miss' 1
+    $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 1
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (preprocessed)' 1
+    checkstat 'cache miss' 1
+
+    ##################################################################
+    # A precompiled header with other content, but the same header.
+    testname="changed pch"
+    $CCACHE -z >/dev/null
+    echo "#define VALUE 2" >other.h
+    $COMPILER -c other.h -o pch.h.gch
+    backdate pch.h.gch
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (preprocessed)' 0
+    checkstat 'cache miss' 1
+    $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache hit (preprocessed)' 1
+    checkstat 'cache miss' 1
+    $CCACHE $COMPILER -c -include pch.h pch.c
+    checkstat 'cache hit (direct)' 1
+    checkstat 'cache miss' 1
+
+    rm -f pch.h pch.c pch.o pch.h.gch first_pch.h.gch reference_pch.h.gch other.h
+
+    CCACHE_NODIRECT=1
+    export CCACHE_NODIRECT
+}
+
 basedir_suite() {
     ##################################################################
     # Create some code to compile.
@@ -1271,7 +1761,7 @@ readonly_suite() {
 
     # Check that readonly mode doesn't try to store new results.
     testname="cache miss"
-    files_before=`find $CCACHE_DIR -type f | wc -l`
+    files_before=`find $CCACHE_DIR -type f ! -path '*.wipe.*' | wc -l`
     CCACHE_READONLY=1 CCACHE_TEMPDIR=/tmp $CCACHE $COMPILER -c test2.c -o test2.o
     if [ $? -ne 0 ]; then
         test_failed "failure when compiling test2.c readonly"
@@ -1279,21 +1769,21 @@ readonly_suite() {
     if [ ! -f test2.o ]; then
         test_failed "test2.o missing"
     fi
-    files_after=`find $CCACHE_DIR -type f | wc -l`
+    files_after=`find $CCACHE_DIR -type f ! -path '*.wipe.*' | wc -l`
     if [ $files_before -ne $files_after ]; then
         test_failed "readonly mode stored files in the cache"
     fi
 
     # Check that readonly mode and direct mode works.
     unset CCACHE_NODIRECT
-    files_before=`find $CCACHE_DIR -type f | wc -l`
+    files_before=`find $CCACHE_DIR -type f ! -path '*.wipe.*' | wc -l`
     CCACHE_READONLY=1 CCACHE_TEMPDIR=/tmp $CCACHE $COMPILER -c test.c -o test.o
     CCACHE_NODIRECT=1
     export CCACHE_NODIRECT
     if [ $? -ne 0 ]; then
         test_failed "failure when compiling test2.c readonly"
     fi
-    files_after=`find $CCACHE_DIR -type f | wc -l`
+    files_after=`find $CCACHE_DIR -type f ! -path '*.wipe.*' | wc -l`
     if [ $files_before -ne $files_after ]; then
         test_failed "readonly mode + direct mode stored files in the cache"
     fi
@@ -1372,11 +1862,24 @@ prepare_cleanup_test() {
 cleanup_suite() {
     testname="clear"
     prepare_cleanup_test $CCACHE_DIR/a
+    # Enough files that deleting them takes much longer than renaming.
+    seq 1 5000 | (cd $CCACHE_DIR/a && split -l 1 -a 4 - filler)
     $CCACHE -C >/dev/null
+    if [ -z "`ls -d $CCACHE_DIR/*.wipe.* 2>/dev/null`" ]; then
+        test_failed "ccache -C waited for the cached files to be deleted"
+    fi
     checkfilecount 0 '*.o' $CCACHE_DIR
     checkfilecount 0 '*.d' $CCACHE_DIR
     checkfilecount 0 '*.stderr' $CCACHE_DIR
     checkstat 'files in cache' 0
+    i=0
+    while [ $i -lt 100 ] && [ -n "`ls -d $CCACHE_DIR/*.wipe.* 2>/dev/null`" ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    if [ -n "`ls -d $CCACHE_DIR/*.wipe.* 2>/dev/null`" ]; then
+        test_failed "Cleared cache contents not deleted"
+    fi
 
     testname="forced cleanup, no limits"
     $CCACHE -C >/dev/null
@@ -1450,10 +1953,101 @@ cleanup_suite() {
     checkstat 'files in cache' 480
     $CCACHE $COMPILER -c empty.c -o empty.o
     # floor(0.8 * 9) = 7
+    waitstat 'files in cache' 469
     checkfilecount 157 '*.o' $CCACHE_DIR
     checkfilecount 156 '*.d' $CCACHE_DIR
     checkfilecount 156 '*.stderr' $CCACHE_DIR
-    checkstat 'files in cache' 469
+
+    testname="sampled autocleanup"
+    $CCACHE -C >/dev/null
+    for x in 0 1 2 3 4 5 6 7 8 9 a b c d e f; do
+        prepare_cleanup_test $CCACHE_DIR/$x
+    done
+    # (9/10) * 30 * 16 = 432
+    $CCACHE -F 432 -M 0 >/dev/null
+    touch empty.c
+    CCACHE_EVICTION=sampled $CCACHE $COMPILER -c empty.c -o empty.o
+    # Whole results are evicted until at most floor(0.8 * 27) = 21 files are
+    # left in the subdirectory; which ones depends on the samples.
+    i=0
+    while [ $i -lt 100 ] && [ `getstat 'files in cache'` -gt 471 ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    files=`getstat 'files in cache'`
+    if [ $files -lt 469 ] || [ $files -gt 471 ]; then
+        test_failed "Unexpected number of files in cache: $files"
+    fi
+    # The counters must match the actual contents.
+    actual=`find $CCACHE_DIR/? -type f ! -name stats ! -name cleanup.lock ! -name costs | wc -l`
+    if [ $actual -ne $files ]; then
+        test_failed "Counted $files files in cache but found $actual"
+    fi
+
+    testname="cost-aware cleanup"
+    $CCACHE -C >/dev/null
+    prepare_cleanup_test $CCACHE_DIR/a
+    touch $CCACHE_DIR/a/*
+    for i in 0 1 2 3 4 5 6 7 8 9; do
+        if [ $i -lt 3 ]; then
+            ms=1
+        else
+            ms=10000
+        fi
+        echo "result$i-4017 $ms 4096" >>$CCACHE_DIR/a/costs
+    done
+    # (9/10) * 30 * 16 = 432
+    $CCACHE -F 432 -M 0 >/dev/null
+    CCACHE_EVICTION=cost $CCACHE -c >/dev/null
+    # floor(0.8 * 9) = 7
+    checkstat 'files in cache' 21
+    for i in 0 1 2; do
+        file=$CCACHE_DIR/a/result$i-4017.o
+        if [ -f $file ]; then
+            test_failed "File $file not removed"
+        fi
+    done
+    if [ `wc -l <$CCACHE_DIR/a/costs` -ne 7 ]; then
+        test_failed "Costs of removed results not forgotten"
+    fi
+
+    testname="cost recording"
+    $CCACHE -C >/dev/null
+    $CCACHE -z >/dev/null
+    touch empty.c
+    CCACHE_EVICTION=cost $CCACHE $COMPILER -c empty.c -o empty.o
+    checkstat 'cache miss' 1
+    checkfilecount 1 costs $CCACHE_DIR
+    if [ `cat $CCACHE_DIR/?/costs | wc -l` -ne 1 ]; then
+        test_failed "Compile cost not recorded"
+    fi
+
+    testname="costs compaction"
+    $CCACHE -C >/dev/null
+    CCACHE_EVICTION=cost $CCACHE $COMPILER -c empty.c -o empty.o
+    costs=`ls $CCACHE_DIR/?/costs`
+    awk 'BEGIN { for (i = 0; i < 20000; i++) print "0/gone" i "-0 1 1" }' >>$costs
+    CCACHE_EVICTION=cost CCACHE_RECACHE=1 $CCACHE $COMPILER -c empty.c -o empty.o
+    i=0
+    while [ $i -lt 100 ] && [ "`cat $costs* | wc -l`" -ne 1 ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    if [ "`cat $costs* | wc -l`" -ne 1 ]; then
+        test_failed "Costs file not compacted"
+    fi
+
+    testname="background cleanup"
+    $CCACHE -C >/dev/null
+    prepare_cleanup_test $CCACHE_DIR/a
+    # (9/10) * 30 * 16 = 432
+    $CCACHE -F 432 -M 0 >/dev/null
+    $CCACHE -c --background >/dev/null
+    # floor(0.8 * 9) = 7
+    waitstat 'files in cache' 21
+    checkfilecount 7 '*.o' $CCACHE_DIR
+    checkfilecount 7 '*.d' $CCACHE_DIR
+    checkfilecount 7 '*.stderr' $CCACHE_DIR
 
     testname="sibling cleanup"
     $CCACHE -C >/dev/null
@@ -1480,6 +2074,95 @@ cleanup_suite() {
         fi
     done
 
+    testname="logged access"
+    $CCACHE -C >/dev/null
+    prepare_cleanup_test $CCACHE_DIR/a
+    # (9/10) * 30 * 16 = 432
+    $CCACHE -F 432 -M 0 >/dev/null
+    echo "result6-4017 `date +%s`" >$CCACHE_DIR/a/access
+    $CCACHE -c >/dev/null
+    # floor(0.8 * 9) = 7
+    checkstat 'files in cache' 21
+    if [ ! -f $CCACHE_DIR/a/result6-4017.o ]; then
+        test_failed "Recently hit result removed"
+    fi
+    for i in 7 8 9; do
+        file=$CCACHE_DIR/a/result$i-4017.o
+        if [ -f $file ]; then
+            test_failed "File $file not removed when it should"
+        fi
+    done
+    if [ -f $CCACHE_DIR/a/access ]; then
+        test_failed "Access log not applied"
+    fi
+
+    testname="hit without mtime update"
+    $CCACHE -C >/dev/null
+    $CCACHE -z >/dev/null
+    echo 'int access_test;' >access.c
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c access.c
+    checkstat 'cache miss' 1
+    find $CCACHE_DIR -name '*.o' | xargs touch -t 199901010000
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c access.c
+    checkstat 'cache hit (preprocessed)' 1
+    if [ -n "`find $CCACHE_DIR -name '*.o' -newer access.c`" ]; then
+        test_failed "Cached object file modified by cache hit"
+    fi
+    if [ `cat $CCACHE_DIR/?/access | wc -l` -ne 1 ]; then
+        test_failed "Cache hit not logged"
+    fi
+
+    testname="access log compaction"
+    $CCACHE -C >/dev/null
+    echo 'int compaction_test;' >compaction.c
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c compaction.c
+    find $CCACHE_DIR -name '*.o' | xargs touch -t 199901010000
+    touch -t 200001010000 compaction.c
+    for dir in $CCACHE_DIR/?; do
+        if [ -n "`find $dir -name '*.o'`" ]; then
+            log=$dir/access
+        fi
+    done
+    awk 'BEGIN { for (i = 0; i < 20000; i++) print "0/gone" i "-0 1" }' >$log
+    CCACHE_NODIRECT=1 $CCACHE $COMPILER -c compaction.c
+    i=0
+    while [ $i -lt 100 ] && [ -n "`ls $log* 2>/dev/null`" ]; do
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    if [ -n "`ls $log* 2>/dev/null`" ]; then
+        test_failed "Access log not compacted"
+    fi
+    if [ -z "`find $CCACHE_DIR -name '*.o' -newer compaction.c`" ]; then
+        test_failed "Logged hit not applied to the object file"
+    fi
+    rm -f compaction.c compaction.o
+
+    testname="stats file conversion"
+    $CCACHE -C >/dev/null
+    prepare_cleanup_test $CCACHE_DIR/a
+    checkstat 'files in cache' 30
+    if [ `wc -c <$CCACHE_DIR/a/stats` -eq 4616 ]; then
+        test_failed "Stats file converted by a read-only operation"
+    fi
+    if ! $CCACHE --print-stats | grep '"cache_size_bytes": 40960,' >/dev/null; then
+        test_failed "Cache size not converted from KiB to bytes"
+    fi
+    $CCACHE -c >/dev/null
+    checkstat 'files in cache' 30
+    if [ `wc -c <$CCACHE_DIR/a/stats` -ne 4616 ]; then
+        test_failed "Text stats file not converted"
+    fi
+
+    testname="exact limits"
+    $CCACHE -F 1000 -M 100001K >/dev/null
+    if ! $CCACHE --print-stats | grep '"max_files": 1000,' >/dev/null; then
+        test_failed "File limit not stored exactly"
+    fi
+    if ! $CCACHE --print-stats | grep '"max_cache_size_bytes": 102401024$' >/dev/null; then
+        test_failed "Size limit not stored exactly"
+    fi
+
     testname="new unknown file"
     $CCACHE -C >/dev/null
     prepare_cleanup_test $CCACHE_DIR/a
@@ -1564,7 +2247,12 @@ distcc
 cpp2
 nlevels4
 nlevels1
+shards256
+server
+batch
+lease
 direct
+pch
 basedir
 compression
 readonly
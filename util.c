@@ -28,6 +28,7 @@
 #include <dirent.h>
 #include <utime.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +41,19 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#define USE_AT_FUNCTIONS 1
+#if defined(__linux__) && defined(SYS_getdents64)
+#define USE_GETDENTS 1
+#endif
+#endif
+
+/* Size of the buffer that directory entries are read into. */
+#define TRAVERSE_BUFFER_SIZE (64 * 1024)
 
 static FILE *logfile;
 
@@ -67,9 +81,16 @@ static void log_prefix(void)
 	char timestamp[100];
 	struct timeval tv;
 	struct tm *tm;
+#ifdef HAVE_LOCALTIME_R
+	struct tm tm_buf;
+#endif
 
 	gettimeofday(&tv, NULL);
+#ifdef HAVE_LOCALTIME_R
+	tm = localtime_r(&tv.tv_sec, &tm_buf);
+#else
 	tm = localtime(&tv.tv_sec);
+#endif
 	strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", tm);
 	fprintf(logfile, "[%s.%06d %-5d] ", timestamp, (int)tv.tv_usec,
 	        (int)getpid());
@@ -89,12 +110,15 @@ void cc_log(const char *format, ...)
 		return;
 	}
 
+	/* Keep lines from cleanup threads in one piece. */
+	flockfile(logfile);
 	log_prefix();
 	va_start(ap, format);
 	vfprintf(logfile, format, ap);
 	va_end(ap);
 	fprintf(logfile, "\n");
 	fflush(logfile);
+	funlockfile(logfile);
 }
 
 /*
@@ -319,6 +343,73 @@ int move_file(const char *src, const char *dest, int compress_dest)
 	return ret;
 }
 
+/*
+ * Write data to a file, optionally compressed. The file is written under a
+ * temporary name and then renamed. Returns 0 on success, otherwise -1.
+ */
+int write_file(const char *path, const void *data, size_t len, int compress)
+{
+	int fd = -1;
+	gzFile gz = NULL;
+	char *tmp_name;
+	mode_t mask;
+	int ret;
+
+	x_asprintf(&tmp_name, "%s.%s.XXXXXX", path, tmp_string());
+	fd = mkstemp(tmp_name);
+	if (fd == -1) {
+		cc_log("mkstemp error: %s", strerror(errno));
+		free(tmp_name);
+		return -1;
+	}
+
+	/* Like in copy_file(), empty files aren't compressed. */
+	if (compress && len > 0) {
+		gz = gzdopen(dup(fd), "wb");
+		if (!gz) {
+			cc_log("gzdopen error: %s", strerror(errno));
+			goto error;
+		}
+		ret = gzwrite(gz, data, len);
+		if (gzclose(gz) != Z_OK || ret != (int)len) {
+			cc_log("gzwrite error: %s", strerror(errno));
+			goto error;
+		}
+	} else if (write(fd, data, len) != (ssize_t)len) {
+		cc_log("write error: %s", strerror(errno));
+		goto error;
+	}
+
+	/* get perms right on the tmp file */
+	mask = umask(0);
+	fchmod(fd, 0666 & ~mask);
+	umask(mask);
+
+	/* the close can fail on NFS if out of space */
+	ret = close(fd);
+	fd = -1;
+	if (ret == -1) {
+		cc_log("close error: %s", strerror(errno));
+		goto error;
+	}
+
+	if (rename(tmp_name, path) == -1) {
+		cc_log("rename error: %s", strerror(errno));
+		goto error;
+	}
+
+	free(tmp_name);
+	return 0;
+
+error:
+	if (fd != -1) {
+		close(fd);
+	}
+	unlink(tmp_name);
+	free(tmp_name);
+	return -1;
+}
+
 /*
  * Like move_file(), but assumes that src is uncompressed and that src and dest
  * are on the same file system.
@@ -328,8 +419,13 @@ move_uncompressed_file(const char *src, const char *dest, int compress_dest)
 {
 	if (compress_dest) {
 		return move_file(src, dest, compress_dest);
+	} else if (rename(src, dest) == 0) {
+		return 0;
+	} else if (errno == EXDEV) {
+		/* e.g. from a CCACHE_TEMPDIR on another file system */
+		return move_file(src, dest, 0);
 	} else {
-		return rename(src, dest);
+		return -1;
 	}
 }
 
@@ -561,44 +657,232 @@ void x_asprintf2(char **ptr, const char *format, ...)
 	}
 }
 
+struct traverse_state {
+	/* Path of the current entry; grows as needed and is reused. */
+	char *path;
+	size_t path_size;
+	int flags;
+	void (*fn)(struct traverse_entry *, void *);
+	void *context;
+};
+
+#ifdef USE_GETDENTS
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
 /*
- * Recursive directory traversal. fn() is called on all entries in the tree.
+ * Stat an entry relative to its directory, only asking for the fields that
+ * ccache uses where the system allows it.
  */
-void traverse(const char *dir, void (*fn)(const char *, struct stat *))
+static int
+stat_entry(int dirfd, const char *name, const char *path, struct stat *st)
 {
-	DIR *d;
-	struct dirent *de;
+#if defined(HAVE_STATX) && defined(STATX_BASIC_STATS)
+	struct statx stx;
+
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW,
+		  STATX_TYPE|STATX_MODE|STATX_MTIME|STATX_SIZE|STATX_BLOCKS,
+		  &stx) == 0) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = stx.stx_mode;
+		st->st_mtime = stx.stx_mtime.tv_sec;
+		st->st_size = stx.stx_size;
+		st->st_blocks = stx.stx_blocks;
+		return 0;
+	}
+	if (errno != ENOSYS) {
+		return -1;
+	}
+#endif
+#ifdef USE_AT_FUNCTIONS
+	(void)path;
+	return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+#else
+	(void)dirfd;
+	(void)name;
+	return lstat(path, st);
+#endif
+}
 
-	d = opendir(dir);
-	if (!d) return;
+/* Translate a d_type value to st_mode bits, or 0 if unknown. */
+static mode_t
+mode_from_dirent_type(unsigned char type)
+{
+#ifdef DT_UNKNOWN
+	switch (type) {
+	case DT_DIR: return S_IFDIR;
+	case DT_REG: return S_IFREG;
+	case DT_LNK: return S_IFLNK;
+	case DT_UNKNOWN: return 0;
+	default: return S_IFIFO; /* Some other kind of non-directory. */
+	}
+#else
+	(void)type;
+	return 0;
+#endif
+}
 
-	while ((de = readdir(d))) {
-		char *fname;
-		struct stat st;
+static void traverse_fd(struct traverse_state *ts, int fd, size_t path_len);
 
-		if (strcmp(de->d_name, ".") == 0) continue;
-		if (strcmp(de->d_name, "..") == 0) continue;
+/* Handle one directory entry found while traversing. */
+static void
+traverse_entry(struct traverse_state *ts, int dirfd, size_t path_len,
+	       const char *name, unsigned char type)
+{
+	struct traverse_entry entry;
+	struct stat st;
+	size_t name_len;
+	int fd;
+
+	if (name[0] == '\0') return;
+	if (strcmp(name, ".") == 0) return;
+	if (strcmp(name, "..") == 0) return;
 
-		if (strlen(de->d_name) == 0) continue;
+	name_len = strlen(name);
+	if (path_len + name_len + 2 > ts->path_size) {
+		ts->path_size = 2 * (path_len + name_len + 2);
+		ts->path = x_realloc(ts->path, ts->path_size);
+	}
+	ts->path[path_len] = '/';
+	memcpy(ts->path + path_len + 1, name, name_len + 1);
 
-		x_asprintf(&fname, "%s/%s", dir, de->d_name);
-		if (lstat(fname, &st)) {
+	memset(&st, 0, sizeof(st));
+	st.st_mode = mode_from_dirent_type(type);
+	if (st.st_mode == 0
+	    || ((ts->flags & TRAVERSE_STAT) && !S_ISDIR(st.st_mode))) {
+		if (stat_entry(dirfd, name, ts->path, &st) != 0) {
 			if (errno != ENOENT) {
-				perror(fname);
+				perror(ts->path);
 			}
-			free(fname);
-			continue;
+			return;
 		}
+	}
 
-		if (S_ISDIR(st.st_mode)) {
-			traverse(fname, fn);
+	entry.path = ts->path;
+	entry.name = ts->path + path_len + 1;
+	entry.dirfd = dirfd;
+	entry.st = &st;
+
+	if (S_ISDIR(st.st_mode)) {
+#ifdef USE_AT_FUNCTIONS
+		fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+#else
+		fd = 0;
+#endif
+		if (fd != -1) {
+			traverse_fd(ts, fd, path_len + 1 + name_len);
 		}
+		/* The path buffer may have moved while recursing. */
+		ts->path[path_len + 1 + name_len] = '\0';
+		entry.path = ts->path;
+		entry.name = ts->path + path_len + 1;
+	}
 
-		fn(fname, &st);
-		free(fname);
+	ts->fn(&entry, ts->context);
+}
+
+/*
+ * Traverse the directory open as fd (whose path is the first path_len
+ * characters of ts->path). Takes over ownership of fd.
+ */
+static void traverse_fd(struct traverse_state *ts, int fd, size_t path_len)
+{
+#ifdef USE_GETDENTS
+	char *buf;
+	long n, offset;
+	struct linux_dirent64 *de;
+
+	buf = x_malloc(TRAVERSE_BUFFER_SIZE);
+	while ((n = syscall(SYS_getdents64, fd, buf, TRAVERSE_BUFFER_SIZE)) > 0) {
+		for (offset = 0; offset < n; offset += de->d_reclen) {
+			de = (struct linux_dirent64 *)(buf + offset);
+			traverse_entry(ts, fd, path_len, de->d_name, de->d_type);
+		}
 	}
+	free(buf);
+	close(fd);
+#else
+	DIR *d;
+	struct dirent *de;
+	unsigned char type;
 
+	ts->path[path_len] = '\0';
+#ifdef USE_AT_FUNCTIONS
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+	fd = dirfd(d);
+#else
+	(void)fd;
+	d = opendir(ts->path);
+	if (!d) return;
+	fd = -1;
+#endif
+	while ((de = readdir(d))) {
+#ifdef DT_UNKNOWN
+		type = de->d_type;
+#else
+		type = 0;
+#endif
+		traverse_entry(ts, fd, path_len, de->d_name, type);
+	}
 	closedir(d);
+#endif
+}
+
+/*
+ * Recursive directory traversal. fn() is called on all entries in the tree,
+ * together with the caller's context pointer; directories are reported after
+ * their contents. Entries are looked up relative to their directory, and only
+ * the file type is known in entry->st unless flags contains TRAVERSE_STAT, in
+ * which case non-directories are stat-ed.
+ */
+void traverse(const char *dir, int flags,
+	      void (*fn)(struct traverse_entry *, void *), void *context)
+{
+	struct traverse_state ts;
+	size_t len = strlen(dir);
+	int fd;
+
+	ts.path_size = len + 256;
+	ts.path = x_malloc(ts.path_size);
+	memcpy(ts.path, dir, len + 1);
+	ts.flags = flags;
+	ts.fn = fn;
+	ts.context = context;
+
+#ifdef USE_AT_FUNCTIONS
+	fd = open(dir, O_RDONLY|O_DIRECTORY);
+	if (fd != -1) {
+		traverse_fd(&ts, fd, len);
+	}
+#else
+	fd = 0;
+	traverse_fd(&ts, fd, len);
+#endif
+
+	free(ts.path);
+}
+
+/* Remove an entry found by traverse(). */
+int traverse_unlink(struct traverse_entry *entry)
+{
+	int is_dir = S_ISDIR(entry->st->st_mode);
+#if defined(USE_AT_FUNCTIONS) && defined(HAVE_UNLINKAT)
+	if (entry->dirfd != -1) {
+		return unlinkat(entry->dirfd, entry->name,
+				is_dir ? AT_REMOVEDIR : 0);
+	}
+#endif
+	return is_dir ? rmdir(entry->path) : unlink(entry->path);
 }
 
 
@@ -646,6 +930,48 @@ const char *get_extension(const char *path)
 	return &path[len];
 }
 
+/*
+ * Read the contents of a file into a new buffer. Returns NULL on failure.
+ * Caller frees.
+ */
+char *read_whole_file(const char *path, size_t *size)
+{
+	char *data = NULL;
+	size_t allocated = 0, len = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return NULL;
+	}
+	do {
+		if (allocated - len < 8192) {
+			allocated = 2 * allocated + 8192;
+			data = x_realloc(data, allocated);
+		}
+		n = read(fd, data + len, allocated - len);
+		if (n > 0) {
+			len += n;
+		}
+	} while (n > 0);
+	close(fd);
+	if (n == -1) {
+		free(data);
+		return NULL;
+	}
+	*size = len;
+	return data;
+}
+
+/* Return whether path is a precompiled header, judging by the extension. */
+int is_precompiled_header(const char *path)
+{
+	const char *ext = get_extension(path);
+
+	return strcmp(ext, ".gch") == 0 || strcmp(ext, ".pch") == 0;
+}
+
 /*
  * Return a string containing the given path without the filename extension.
  * Caller frees.
@@ -655,7 +981,7 @@ char *remove_extension(const char *path)
 	return x_strndup(path, strlen(path) - strlen(get_extension(path)));
 }
 
-static int lock_fd(int fd, short type)
+static int lock_fd(int fd, short type, int cmd)
 {
 	struct flock fl;
 	int ret;
@@ -669,26 +995,32 @@ static int lock_fd(int fd, short type)
 	/* not sure why we would be getting a signal here,
 	   but one user claimed it is possible */
 	do {
-		ret = fcntl(fd, F_SETLKW, &fl);
+		ret = fcntl(fd, cmd, &fl);
 	} while (ret == -1 && errno == EINTR);
 	return ret;
 }
 
 int read_lock_fd(int fd)
 {
-	return lock_fd(fd, F_RDLCK);
+	return lock_fd(fd, F_RDLCK, F_SETLKW);
 }
 
 int write_lock_fd(int fd)
 {
-	return lock_fd(fd, F_WRLCK);
+	return lock_fd(fd, F_WRLCK, F_SETLKW);
+}
+
+/* Like write_lock_fd(), but fail instead of waiting if the lock is taken. */
+int try_write_lock_fd(int fd)
+{
+	return lock_fd(fd, F_WRLCK, F_SETLK);
 }
 
-/* return size on disk of a file */
-size_t file_size(struct stat *st)
+/* return size on disk of a file, in bytes */
+uint64_t file_size(struct stat *st)
 {
-	size_t size = st->st_blocks * 512;
-	if ((size_t)st->st_size > size) {
+	uint64_t size = (uint64_t)st->st_blocks * 512;
+	if ((uint64_t)st->st_size > size) {
 		/* probably a broken stat() call ... */
 		size = (st->st_size + 1023) & ~1023;
 	}
@@ -709,24 +1041,23 @@ int safe_open(const char *fname)
 	return fd;
 }
 
-/* Format a size (in KiB) as a human-readable string. Caller frees. */
-char *format_size(size_t v)
+/* Format a size (in bytes) as a human-readable string. Caller frees. */
+char *format_size(uint64_t v)
 {
 	char *s;
-	if (v >= 1024*1024) {
-		x_asprintf(&s, "%.1f Gbytes", v/((double)(1024*1024)));
-	} else if (v >= 1024) {
-		x_asprintf(&s, "%.1f Mbytes", v/((double)(1024)));
+	if (v >= 1024*1024*1024) {
+		x_asprintf(&s, "%.1f Gbytes", v/((double)(1024*1024*1024)));
+	} else if (v >= 1024*1024) {
+		x_asprintf(&s, "%.1f Mbytes", v/((double)(1024*1024)));
 	} else {
-		x_asprintf(&s, "%.0f Kbytes", (double)v);
+		x_asprintf(&s, "%.0f Kbytes", v/((double)1024));
 	}
 	return s;
 }
 
-/* return a value in multiples of 1024 give a string that can end
-   in K, M or G
+/* return a value in bytes given a string that can end in K, M or G
 */
-size_t value_units(const char *s)
+uint64_t value_units(const char *s)
 {
 	char m;
 	double v = atof(s);
@@ -735,18 +1066,18 @@ size_t value_units(const char *s)
 	case 'G':
 	case 'g':
 	default:
-		v *= 1024*1024;
+		v *= 1024*1024*1024;
 		break;
 	case 'M':
 	case 'm':
-		v *= 1024;
+		v *= 1024*1024;
 		break;
 	case 'K':
 	case 'k':
-		v *= 1;
+		v *= 1024;
 		break;
 	}
-	return (size_t)v;
+	return (uint64_t)v;
 }
 
 